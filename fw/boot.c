@@ -0,0 +1,178 @@
+/* LEDclock serial loader
+ * Developed for Atmel ATTiny2313 MCU
+ *
+ * Takes the last BOOT_SIZE bytes of the flash. ATtiny2313 has
+ * no boot section (SELFPRGEN fuse lets any code use SPM), so the
+ * application's reset vector jumps here and its own one is moved
+ * to the word right below the loader (APP_ENTRY) by the uploader.
+ *
+ * Loader stays only if RXD (PD0, the minutes button) is held low
+ * at reset - by the uploader's break or by hand, otherwise the
+ * application starts at once. Protocol, 9600 8N1, every command
+ * is answered:
+ * S               - sync, "L" and the number of application pages,
+ * W p d[32] c[2]  - write page p, c is CRC-16 (XMODEM, MSB first)
+ *                   of p and the data, "K" once written and read
+ *                   back, "E" on a bad CRC, page or read-back,
+ * Q               - quit, "Q" and a watchdog reset.
+ * Anything else is ignored, 8 s without a byte reset too. Word 0
+ * always keeps the jump to the loader, so a broken upload can be
+ * repeated. MCUSR is left for the application.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#include <avr/boot.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
+
+#ifndef BOOT_START
+#error "BOOT_START is set by the Makefile"
+#endif
+
+#define CPU_HZ    8000000L
+#define UART_BAUD 9600L
+#define UART_UBRR ((CPU_HZ + 4 * UART_BAUD) / (8 * UART_BAUD) - 1) /* U2X */
+
+#define APP_PAGES (BOOT_START / SPM_PAGESIZE)
+#define APP_ENTRY (BOOT_START - 2)                           /* Moved reset vector */
+#define BOOT_RJMP (0xc000 | ((BOOT_START / 2 - 1) & 0x0fff)) /* rjmp from word 0 */
+
+/* avr-libc has no macro for CTPB (clear temporary page buffer) */
+#ifndef boot_page_clear
+#define boot_page_clear() \
+	__asm__ __volatile__ ("out %0, %1\n\tspm" :: "I" (_SFR_IO_ADDR(SPMCSR)), \
+		"r" ((uint8_t)((1 << CTPB) | (1 << SELFPRGEN))))
+#endif
+
+typedef unsigned char byte;
+
+/* No start files, the loader starts with main */
+int main(void) __attribute__((OS_main, section(".init9")));
+
+
+static void __attribute__((noreturn)) boot_exit(void)
+{
+	wdt_enable(WDTO_15MS);
+	for (;;)
+		;
+}
+
+
+static byte uart_get(void)
+{
+	while (!(UCSRA & (1 << RXC))) {
+		wdt_reset();
+		/* Timer1 overflow, 8.4 s without a byte */
+		if (TIFR & (1 << TOV1))
+			boot_exit();
+	}
+
+	TCNT1 = 0;
+
+	return UDR;
+}
+
+
+static void uart_put(byte c)
+{
+	while (!(UCSRA & (1 << UDRE)))
+		;
+	UDR = c;
+}
+
+
+static uint16_t crc_update(uint16_t crc, byte c)
+{
+	return _crc_xmodem_update(crc, c);
+}
+
+
+/* Page buffer is filled as the data comes, flash is written
+ * only if the CRC matches */
+static byte page_write(void)
+{
+	byte page = uart_get(), i;
+	uint16_t addr = page * SPM_PAGESIZE, crc = crc_update(0, page), w;
+
+	for (i = 0; i < SPM_PAGESIZE; i += 2) {
+		w = uart_get();
+		crc = crc_update(crc, w);
+		w |= uart_get() << 8;
+		crc = crc_update(crc, w >> 8);
+
+		if (addr + i == 0)
+			w = BOOT_RJMP;
+		boot_page_fill(addr + i, w);
+	}
+
+	w = uart_get() << 8;
+	w |= uart_get();
+
+	/* Buffer takes each word once, it has to be clean for a retry */
+	if (w != crc || page >= APP_PAGES) {
+		boot_page_clear();
+		return 'E';
+	}
+
+	boot_page_erase(addr);
+	boot_spm_busy_wait();
+	wdt_reset();
+	boot_page_write(addr);
+	boot_spm_busy_wait();
+
+	crc = crc_update(0, page);
+	for (i = 0; i < SPM_PAGESIZE; ++i)
+		crc = crc_update(crc, pgm_read_byte(addr + i));
+
+	return crc == w ? 'K' : 'E';
+}
+
+
+int main(void)
+{
+	byte i = 0;
+
+#ifdef __AVR__
+	__asm__ __volatile__ ("clr __zero_reg__");
+#endif
+
+	/* Pull-up has a while to charge the line, RXD has to stay low */
+	PORTD = 1 << 0;
+	do {
+		if (PIND & (1 << 0)) {
+			PORTD = 0;
+			((void (*)(void))(uintptr_t)(APP_ENTRY / 2))();
+		}
+	} while (--i);
+
+	/* Break ends */
+	while (!(PIND & (1 << 0)))
+		wdt_reset();
+
+	UBRRL = UART_UBRR;
+	UCSRA = 1 << U2X;
+	UCSRB = (1 << RXEN) | (1 << TXEN);
+	TCCR1B = (1 << CS12) | (1 << CS10);
+
+	for (;;) {
+		switch (uart_get()) {
+			case 'S':
+				uart_put('L');
+				uart_put(APP_PAGES);
+				break;
+
+			case 'W':
+				uart_put(page_write());
+				break;
+
+			case 'Q':
+				uart_put('Q');
+				boot_exit();
+		}
+	}
+}
@@ -11,12 +11,60 @@
  * - time setting via two buttons (one for minutes, one for hours),
  * - long press button to set time faster,
  * - blinking after power loss to indicate that the time is incorrect,
- * - RTC calibration with 1 ppm precision (+- 999 ppms),
+ * - RTC calibration with ~0.5 ppm precision (+- 999 steps, 2 ticks
+ *   per 2048 seconds each, ~476 ppm),
  * - slow, gradual enabling/disabling changed screen segments (PWM),
  * - brightness setting (0-7),
+ * - dead time with every digit off between digits, against ghosting
+ *   (DEAD_TIME Timer0 counts),
  * - watchdog,
  * - calibration and brighness storage on eeprom.
  *
+ * Optional features (enable with make FEATURES="-DNAME ..."):
+ * - PPS_CALIB - automatic RTC calibration from 1PPS reference on PA0,
+ * - LEARN_CALIB - RTC calibration learnt from user's time corrections,
+ * - WARM_RESET - time kept over watchdog, brown-out and external resets,
+ * - POWERFAIL - time saved on supply failure (sense on PA1), restored
+ *   as approximate after power-up,
+ * - PARAMS_RING - settings kept as CRC-checked records in a ring of
+ *   EEPROM slots (writes spread, torn records skipped) instead of
+ *   at a fixed address,
+ * - HOLDOVER - with POWERFAIL, keep counting time on the bulk capacitor
+ *   (supercap) in power-down sleep while the supply is off,
+ * - CLOCK_SCALING - CPU clock divided down while the display is static
+ *   and the buttons are idle,
+ * - OSC_CALIB - internal RC oscillator (OSCCAL) trimmed against the
+ *   crystal, so the display timing doesn't drift,
+ * - XTAL_FALLBACK - time counted from the internal RC oscillator
+ *   (Timer1) when the crystal or 4060 stops,
+ * - UART - serial commands (time, calibration, brightness) on the
+ *   button lines instead of the buttons,
+ * - LOADER - with UART, a command resetting into the serial loader
+ *   (set by make LOADER=1, which builds the loader as well),
+ * - FIXED_SETTINGS - calibration (RTC_CALIB) and brightness
+ *   (BRIGHTNESS_LEVEL) set at build time, the buttons only set the
+ *   time and nothing is kept on the EEPROM, leaves room for the
+ *   serial loader (set by make LOADER=1),
+ * - NMEA - with UART, time taken from a GPS module (NMEA sentences
+ *   on RXD and 1PPS on PA0),
+ * - SYNC - clocks kept in step over a shared line on PA1, the master
+ *   sends the time every minute, followers lock to it,
+ * - TELEMETRY - with UART, a binary frame of the interrupt timing and
+ *   counters sent every second,
+ * - EVENT_TRACE - ring of the latest events (handlers, buttons, modes,
+ *   EEPROM writes) kept over a watchdog reset and copied to EEPROM,
+ *   EVENT_QUIET leaves out the tick and multiplex handlers,
+ * - LOOKAHEAD - next minute's ramp starts early, so the cross-fade
+ *   is half way exactly at the minute,
+ * - EASING - cross-fades follow a curve from flash (linear, ease-in-out,
+ *   perceptual, exponential) over EASE_MS, whatever the brightness,
+ * - DOTS_FADE - dots fade in and out with the ramp every second,
+ * - BRIGHT_FADE - brightness changes fade over BRIGHT_FADE_MS,
+ * - LIGHT_SENSE - brightness follows ambient light, LDR discharging
+ *   a capacitor on PA0 (not with PPS_CALIB or NMEA),
+ * - SCHEDULE - brightness or a blank display by the time of day, from
+ *   a table on the EEPROM.
+ *
  * Copyright 2022 Aleksander Kaminski
  *
  * Free for non-commercial use and education purposes.
@@ -24,9 +72,37 @@
 
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <avr/sleep.h>
 #include <avr/wdt.h>
 #include <avr/eeprom.h>
+#include <util/crc16.h>
+
+#if defined(HOLDOVER) && !defined(POWERFAIL)
+#error "HOLDOVER needs POWERFAIL"
+#endif
+
+#if defined(NMEA) && !defined(UART)
+#error "NMEA needs UART"
+#endif
+
+#if defined(SYNC) && defined(POWERFAIL)
+#error "SYNC and POWERFAIL share PA1"
+#endif
+
+#if defined(TELEMETRY) && !defined(UART)
+#error "TELEMETRY needs UART"
+#endif
+
+#if defined(LIGHT_SENSE) && (defined(PPS_CALIB) || defined(NMEA))
+#error "LIGHT_SENSE and 1PPS share PA0"
+#endif
+
+#if defined(FIXED_SETTINGS) && (defined(PPS_CALIB) || defined(LEARN_CALIB) || \
+		defined(WARM_RESET) || defined(PARAMS_RING) || defined(UART) || \
+		defined(SYNC) || defined(EASING))
+#error "FIXED_SETTINGS leaves out the settings store this feature needs"
+#endif
 
 #define BUTTON_COOLDOWN  200  /* In about 1 ms */
 #define BUTTON_LONGPRESS 2000 /* In about 1 ms */
@@ -34,30 +110,154 @@
 #define BRIGHTNESS       50   /* Base brightness (x/256) */
 #define BRIGHTNESS_STEP  25
 #define LED_VOID         10   /* Code for empty digit */
+#define LED_DOTS         0x80 /* PB7 */
+#define DOTS_DIGIT       1    /* Multiplex slot the dots are lit in */
+#ifndef RTC_CALIB
 #define RTC_CALIB        0    /* +-ppm */
+#endif
+#ifndef BRIGHTNESS_LEVEL
+#define BRIGHTNESS_LEVEL 4    /* 0-8 */
+#endif
 #define RTC_HZ           2048
 #define RAMP_MIN         10   /* Minimal PWM (x/256) */
-#define RAMP_MAX         (BRIGHTNESS + (g_brightness * BRIGHTNESS_STEP) - 10)
+#define RAMP_MAX         (OCR0B - 10)
 #define RAMP_INC         2    /* Increased on every screen refresh (122 Hz) */
-#define ADDR_CALIBRATION ((void *)0)
-#define ADDR_BRIGHNESS   ((void *)2)
+#define ADDR_PARAMS      ((byte *)0)
+#define PARAMS_VERSION   1
+#define PPS_PIN          0    /* PA0 */
+#ifndef PPS_WINDOW
+#define PPS_WINDOW       1024 /* Seconds, one calibration step resolution */
+#endif
+#define PPS_TOLERANCE    4    /* Max ticks of pulse to pulse deviation */
+#if PPS_WINDOW < 1 || PPS_WINDOW > 32767 / PPS_TOLERANCE
+#error "PPS_WINDOW must be 1 to 8191 seconds, deviation sum is an int"
+#endif
+#define LEARN_MIN_SECS   (7 * 86400L) /* Shortest observation to calibrate */
+#define LEARN_MAX_CORR   300  /* Larger correction is a time set (s) */
+#define LEARN_MAX_STEP   100  /* Largest calibration change at once */
+#define WARM_STARTUP     (RTC_HZ * 65L / 1000) /* Reset start-up delay (ticks) */
+#define WARM_WDT         (RTC_HZ * 256L / 1000) /* Watchdog timeout (ticks) */
+#define WARM_MAGIC       0xa5
+#define WARM_STORE       60   /* Seconds run before reset counters are stored */
+#define TIME_APPROX      2    /* g_time_set after power or crystal failure */
+#define PF_PIN           1    /* PA1, supply sense, low on failure */
+#define LIGHT_PIN        0    /* PA0, capacitor and LDR to ground */
+#define LIGHT_PERIOD     512  /* Ticks between samples, power of 2 */
+#define LIGHT_CHARGE     4    /* Ticks charging the capacitor */
+#define LIGHT_MAX        255  /* Discharge ticks in the dark */
+#define SCHED_ENTRIES    4
+#define SCHED_SIZE       (2 * SCHED_ENTRIES)
+#define SCHED_TIME       0x7ff /* Minute of the day, level in bits 12-15 */
+#define SCHED_OFF        15   /* Level of a blank display */
+#define SCHED_WAKE       30   /* Seconds a button lights a blank display */
+#define PF_DEBOUNCE      2    /* Ticks of low supply to trip */
+#define PF_RECOVER       RTC_HZ /* Ticks of good supply to resume */
+#define PF_SLOT          6    /* seq, hours, minutes, seconds, alive, checksum */
+#define PF_SLOTS         8
+#define ADDR_PF_RING     ((byte *)PARAMS_SIZE)
+#define T0_PRESCALER     ((1 << CS01) | (1 << CS00)) /* 1/64 */
+#define HOLDOVER_CLKPS   2    /* 2 MHz CPU clock in holdover */
+#define CLOCK_SLOW       3    /* 1 MHz CPU clock when idle */
+#define T0_PRESCALER_SLOW (1 << CS01) /* 1/8, same Timer0 tick */
+#define T0_SLOW_LATENCY  19   /* Timer0 counts of the tick handler at 1 MHz */
+#define CPU_HZ           8000000L
+#define OSC_TICKS        16   /* RC oscillator measurement window */
+#define OSC_CYCLES       ((unsigned int)(OSC_TICKS * CPU_HZ / RTC_HZ))
+#define OSC_TOLERANCE    200  /* 0.5%, about a half of OSCCAL step */
+#define FALLBACK_TICK    (CPU_HZ * 256 / RTC_HZ) /* CPU cycles per tick, 8.8 */
+#define PF_CHECKPOINT    240  /* Seconds between saves in holdover */
+#define UART_BAUD        9600L
+#define UART_UBRR(clkps) (((CPU_HZ >> (clkps)) + 4 * UART_BAUD) / (8 * UART_BAUD) - 1) /* U2X */
+#define UART_RING        16   /* Power of two */
+#define UART_LINE        12
+#define UART_QUIET       64   /* Ticks without traffic before the clock changes */
+#define NMEA_INTERVAL    3600 /* Seconds between GPS time updates */
+#define SYNC_PIN         1    /* PA1, open drain line shared by the clocks */
+#define SYNC_SLOT        16   /* Ticks per pulse slot */
+#define SYNC_MARK        8    /* Ticks low, minute marker */
+#define SYNC_ZERO        4
+#define SYNC_ONE         12
+#define SYNC_BITS        12   /* Minute of the day and even parity */
+#define SYNC_FRAME       ((SYNC_BITS + 1) * SYNC_SLOT)
+#define SYNC_IDLE        (2 * SYNC_SLOT) /* Ticks high before a marker */
+#define TEL_SYNC         0xa5 /* Frame start, never in the text answers */
+#define FRAME_US         (4 * 256 * 64L * 1000 / (CPU_HZ / 1000)) /* Multiplex frame, 8192 us */
+#define EASE_STEPS       32   /* Curve table entries */
+#define EASE_CURVES      4
+#define TEL_FRAME        11
+#define TEL_TICK         ((unsigned int)(CPU_HZ / RTC_HZ)) /* CPU cycles per tick */
+#define STACK_PAINT      0xc5
+#ifndef EVENT_RING
+#define EVENT_RING       8    /* Events kept, 3 bytes of RAM and EEPROM each */
+#endif
+
+#ifndef EASE_MS
+#define EASE_MS          500  /* Cross-fade duration with EASING */
+#endif
+#define EASE_STEP        ((unsigned int)(EASE_STEPS * 256L * FRAME_US / (EASE_MS * 1000L))) /* x/256 per frame */
+#define EASE_STEP_TICKS  ((unsigned int)(EASE_MS * (long)RTC_HZ / 1000 / EASE_STEPS))
+#ifndef DEAD_TIME
+#ifdef CLOCK_SCALING
+#define DEAD_TIME        24   /* Timer0 counts with every digit off, tick handler at 1 MHz */
+#else
+#define DEAD_TIME        8    /* Timer0 counts with every digit off before the next one */
+#endif
+#endif
+#if DEAD_TIME > 256 - BRIGHTNESS
+#error "DEAD_TIME leaves no room for the brightness levels"
+#endif
+#if defined(CLOCK_SCALING) && DEAD_TIME < T0_SLOW_LATENCY
+#error "DEAD_TIME shorter than the tick handler at 1 MHz, slots would be lost"
+#endif
+#ifndef BRIGHT_FADE_MS
+#define BRIGHT_FADE_MS   300  /* Brightness change duration with BRIGHT_FADE */
+#endif
+#define BRIGHT_FADE_FRAMES ((BRIGHT_FADE_MS * 1000L + FRAME_US / 2) / FRAME_US)
+#if BRIGHT_FADE_MS < 10 || BRIGHT_FADE_MS > 1000
+#error "BRIGHT_FADE_MS out of 10-1000" /* Step rounding holds up to 1 s */
+#endif
+#define EVENT_SIZE       (3 * EVENT_RING)
+#define EVENT_FROZEN     0xff /* Ring position until the copy is done */
 
 
 typedef unsigned char byte;
 
-
-int g_subseconds;
-unsigned int g_seconds_calib_cnt;
-byte g_seconds;
-byte g_minutes;
-byte g_hours = 12;
-byte g_time_set;
+#ifdef WARM_RESET
+/* Not cleared on startup, validated by time_restore() */
+#define NOINIT __attribute__((section(".noinit")))
+#else
+#define NOINIT
+#endif
+
+
+int g_subseconds NOINIT;
+unsigned int g_seconds_calib_cnt NOINIT;
+byte g_seconds NOINIT;
+byte g_minutes NOINIT;
+byte g_hours NOINIT;
+byte g_time_set NOINIT;
+#ifdef WARM_RESET
+byte g_time_chk NOINIT;
+byte g_resets_store;       /* Seconds until the reset counters are stored */
+#endif
 
 byte g_led_on[4];
 byte g_led_rampup[4];
 byte g_led_rampdown[4];
 byte g_rampcnt = RAMP_MIN;
 byte g_curr_digit;
+byte g_dots;
+#ifdef LOOKAHEAD
+byte g_ahead; /* Screen shows the next minute */
+#endif
+#ifdef BRIGHT_FADE
+unsigned int g_bright_pos; /* OCR0B x256 while fading */
+int g_bright_step;
+byte g_bright_frames;
+#endif
+#ifdef EASING
+unsigned int g_ease_pos; /* Curve position (x/256) */
+#endif
 
 unsigned int g_button_presscnt[2];
 enum {
@@ -69,48 +269,498 @@ enum {
 
 enum {
 	mode_normal = 0,
+#ifndef FIXED_SETTINGS
 	mode_calib,
 	mode_brightness,
+#endif
+#ifdef SYNC
+	mode_sync,
+#endif
+#ifdef EASING
+	mode_ease,
+#endif
 	mode_end
 } g_mode = mode_normal;
 byte g_mode_timeout;
-int g_rtc_calib = RTC_CALIB;
-byte g_brightness = 4;
+
+/* Everything stored on the EEPROM, fixed size types
+ * keep the layout the same in the host simulator */
+struct params {
+	int16_t rtc_calib;
+	uint8_t brightness;
+#ifdef LEARN_CALIB
+	uint32_t learn_secs;
+	int16_t learn_corr;
+#endif
+#ifdef WARM_RESET
+	uint16_t resets[4]; /* PORF, EXTRF, BORF, WDRF */
+#endif
+#ifdef SYNC
+	uint8_t sync_master;
+#endif
+#ifdef EASING
+	uint8_t ease;
+#endif
+} __attribute__((packed)) g_params NOINIT;
+#ifdef PARAMS_RING
+byte g_params_slot;
+byte g_params_seq;
+#endif
+#ifndef FIXED_SETTINGS
+volatile byte g_params_pending; /* Changed by a handler, stored by the main loop */
+#endif
+
+#ifdef EVENT_TRACE
+#define ADDR_EVENTS      ((byte *)(E2END + 1 - EVENT_SIZE))
+#define EVENTS_START     (E2END + 1 - EVENT_SIZE)
+#else
+#define EVENTS_START     (E2END + 1)
+#endif
+#ifdef SCHEDULE
+#define ADDR_SCHEDULE    ((uint16_t *)(EVENTS_START - SCHED_SIZE))
+#define EEPROM_END       (EVENTS_START - SCHED_SIZE)
+#else
+#define EEPROM_END       EVENTS_START
+#endif
+#ifdef POWERFAIL
+#define PARAMS_SIZE      (EEPROM_END - PF_SLOTS * PF_SLOT)
+#else
+#define PARAMS_SIZE      EEPROM_END
+#endif
+#define PARAMS_SLOT      (sizeof(struct params) + 2) /* seq, params, CRC */
+#define PARAMS_SLOTS     (PARAMS_SIZE / PARAMS_SLOT)
+#ifdef PARAMS_RING
+_Static_assert(PARAMS_SLOTS >= 2, "EEPROM left for the parameter store holds less than 2 records");
+#else
+_Static_assert(sizeof(struct params) <= PARAMS_SIZE, "EEPROM left for the parameter store is too small");
+#endif
+
+#ifdef LEARN_CALIB
+long g_learn_adjust;
+byte g_learn_active;
+byte g_learn_full;
+byte g_learn_timeout;
+#endif
+
+#ifdef POWERFAIL
+enum {
+	pf_none = 0,
+	pf_recovered, /* Saved record to be invalidated */
+	pf_failing,   /* Screen off, record to be saved */
+	pf_saved,
+	pf_holdover   /* Counting time in power-down */
+};
+volatile byte g_pf_state;
+volatile byte g_pf_alive;
+byte g_pf_cnt;
+unsigned int g_pf_ok;
+byte g_pf_slot;
+byte g_pf_seq;
+byte g_pf_record;
+#endif
+
+#ifdef CLOCK_SCALING
+byte g_clock_slow;
+#endif
+
+#ifdef OSC_CALIB
+byte g_osc_cnt;
+byte g_osc_clkpr;
+uint16_t g_osc_start;
+#endif
+
+#ifdef XTAL_FALLBACK
+volatile byte g_fallback;
+byte g_fallback_frac;
+#endif
+
+#ifdef UART
+byte g_uart_rx[UART_RING];
+volatile byte g_uart_rx_head;
+byte g_uart_rx_tail;
+byte g_uart_tx[UART_RING];
+byte g_uart_tx_head;
+volatile byte g_uart_tx_tail;
+volatile byte g_uart_quiet;
+char g_uart_line[UART_LINE];
+byte g_uart_len;
+#endif
+
+#ifdef NMEA
+struct {
+	byte active;
+	byte field;
+	byte pos;
+	byte sum;
+	byte star;  /* Checksum characters after '*' plus one */
+	byte chk;
+	byte valid;
+	byte fix;
+	uint16_t id;
+	byte time[3];
+} g_nmea;
+byte g_nmea_hours;
+byte g_nmea_minutes;
+byte g_nmea_seconds;
+unsigned int g_nmea_age = RTC_HZ; /* Ticks since the sentence */
+unsigned int g_nmea_wait;
+byte g_nmea_level;
+#endif
+
+#ifdef SYNC
+struct {
+	byte tx;      /* Master, ticks of the frame left */
+	byte low;     /* Ticks low, sent or seen */
+	uint16_t data;
+	byte level;   /* Follower from here on */
+	byte idle;    /* Ticks high */
+	byte bits;    /* Pulses of the frame left */
+	uint16_t cnt; /* Ticks since the marker */
+	byte far;     /* Marker more than a second off */
+	byte age;     /* Seconds since the marker */
+	byte run;     /* Calibration window */
+	byte start;
+	byte applied; /* Calibration applied in the window */
+	byte minutes;
+	long drift;
+} g_sync;
+#endif
+
+#ifdef TELEMETRY
+struct {
+	uint16_t last;     /* TCNT1 at the last tick */
+	uint16_t int0_max; /* Longest INT0 handler (CPU cycles) */
+	uint16_t t0;       /* Timer0 interrupts */
+	byte missed;
+	byte armed;        /* Last tick counts */
+	byte due;
+	byte seq;
+} g_tel;
+#endif
+
+#ifdef EVENT_TRACE
+/* Tags, low nibble is an argument */
+enum {
+	ev_start = 0x00,  /* Reset cause (MCUSR) */
+	ev_int0 = 0x10,
+	ev_int0_end,
+	ev_t0_ovf = 0x20,
+	ev_t0_compa,
+	ev_t0_compb,
+	ev_uart_rx = 0x30,
+	ev_uart_udre,
+	ev_wdt = 0x40,
+	ev_t1_compb,
+	ev_button = 0x50, /* Button */
+	ev_mode = 0x60,   /* New mode */
+	ev_params = 0x70,
+	ev_powerfail
+};
+
+/* Tag, TCNT0 and the low byte of g_subseconds per event */
+byte g_events[EVENT_SIZE] __attribute__((section(".noinit")));
+byte g_event_pos __attribute__((section(".noinit")));
+byte g_event_from __attribute__((section(".noinit"))); /* Oldest one when frozen */
+
+/* Few cycles, no loop. Event logged from the main loop can be
+ * overwritten by an interrupt's one */
+static inline void event_log(byte tag)
+{
+	byte pos = g_event_pos, *p = g_events + pos;
+
+	if (pos == EVENT_FROZEN)
+		return;
+
+	p[0] = tag;
+	p[1] = TCNT0;
+	p[2] = g_subseconds;
+	pos += 3;
+	g_event_pos = pos < EVENT_SIZE ? pos : 0;
+}
+
+#define EVENT(tag) event_log(tag)
+#ifdef EVENT_QUIET
+#define EVENT_ISR(tag)
+#else
+#define EVENT_ISR(tag) event_log(tag)
+#endif
+#else
+#define EVENT(tag)
+#define EVENT_ISR(tag)
+#endif
+
+#ifdef PPS_CALIB
+unsigned int g_pps_interval;
+unsigned int g_pps_cnt;
+int g_pps_dev;
+byte g_pps_level;
+#endif
+
+#ifdef LIGHT_SENSE
+byte g_light_cnt;          /* Discharge ticks, 0 - not measuring */
+unsigned int g_light_avg;  /* Filtered discharge ticks x256 */
+byte g_light;              /* Brightness level for the light */
+#endif
+
+#ifdef SCHEDULE
+uint16_t g_sched_table[SCHED_ENTRIES]; /* Copy of the EEPROM table */
+byte g_sched;              /* Level of the current entry, SCHED_OFF */
+byte g_sched_wake;         /* Seconds left lit by a button */
+#endif
+
+#if defined(LIGHT_SENSE) || defined(SCHEDULE)
+byte g_bright_set;         /* Level applied */
+#endif
+
+
+/* Level set with the buttons, lower in the dark with LIGHT_SENSE
+ * or at the time with SCHEDULE (except while it's being set) */
+static byte brightness_level(void)
+{
+	byte level = g_params.brightness;
+
+#ifndef FIXED_SETTINGS
+	if (g_mode == mode_brightness)
+		return level;
+#endif
+#ifdef LIGHT_SENSE
+	if (g_light < level)
+		level = g_light;
+#endif
+#ifdef SCHEDULE
+	if (g_sched < level)
+		level = g_sched;
+#endif
+
+	return level;
+}
 
 
 static void set_brightness(void)
 {
-	OCR0B = BRIGHTNESS + (g_brightness * BRIGHTNESS_STEP);
+	byte level = BRIGHTNESS + (brightness_level() * BRIGHTNESS_STEP);
+
+#if DEAD_TIME > 256 - BRIGHTNESS - 8 * BRIGHTNESS_STEP
+	/* COMPB turns the digit off at least DEAD_TIME before OVF turns
+	 * the next one on, so the drivers are off by then, and a handler
+	 * holding COMPB back doesn't let OVF run first (lighting the same
+	 * digit again, the late COMPB would blank the next slot) */
+	if (level > 256 - DEAD_TIME)
+		level = 256 - DEAD_TIME;
+#endif
+
+#if defined(LIGHT_SENSE) || defined(SCHEDULE)
+	g_bright_set = brightness_level();
+#endif
+#ifdef BRIGHT_FADE
+	/* Frame wrap moves OCR0B there, set at once on power-up and
+	 * with Timer0 stopped. Half a count of rounding covers the
+	 * truncated step. */
+	if (OCR0B && TCCR0B) {
+		g_bright_pos = (OCR0B << 8) + 128;
+		g_bright_step = ((long)(level - OCR0B) << 8) / BRIGHT_FADE_FRAMES;
+		g_bright_frames = BRIGHT_FADE_FRAMES;
+		return;
+	}
+#endif
+	OCR0B = level;
+}
+
+
+#if defined(PARAMS_RING) || defined(POWERFAIL)
+/* Index of the newest record in a ring of EEPROM slots, each
+ * starting with a sequence number. Newest record is followed
+ * by an out of sequence one (or an erased slot). */
+static byte ring_newest(byte *ring, byte size, byte slots)
+{
+	byte i;
+
+	for (i = 0; i < slots - 1; ++i, ring += size) {
+		if (eeprom_read_byte(ring + size) != (byte)(eeprom_read_byte(ring) + 1))
+			break;
+	}
+
+	return i;
+}
+#endif
+
+
+#ifdef PARAMS_RING
+/* Parameter store. Every change appends a record (sequence
+ * number, struct params, CRC-8) to a ring of slots over the
+ * EEPROM, so the writes are spread evenly. CRC is seeded with
+ * the version and size of the layout, so records of another
+ * firmware build are not taken. */
+static byte *params_slot(byte slot)
+{
+	return ADDR_PARAMS + slot * PARAMS_SLOT;
+}
+
+
+static byte params_crc(byte seq)
+{
+	const byte *p = (const byte *)&g_params;
+	byte crc = _crc8_ccitt_update(PARAMS_VERSION + sizeof(g_params), seq);
+
+	for (byte i = 0; i < sizeof(g_params); ++i)
+		crc = _crc8_ccitt_update(crc, p[i]);
+
+	return crc;
+}
+
+
+/* Returns 1 if the slot holds a valid record, loaded to g_params */
+static byte params_read(byte slot)
+{
+	byte *addr = params_slot(slot), *p = (byte *)&g_params;
+
+	for (byte i = 0; i < sizeof(g_params); ++i)
+		p[i] = eeprom_read_byte(addr + 1 + i);
+
+	return eeprom_read_byte(addr + PARAMS_SLOT - 1) == params_crc(eeprom_read_byte(addr));
+}
+
+
+/* Writes only if parameters differ from the newest record */
+static void store_params(void)
+{
+	byte *addr = params_slot(g_params_slot);
+	const byte *p = (const byte *)&g_params;
+	byte i;
+
+	for (i = 0; i < sizeof(g_params); ++i) {
+		if (eeprom_read_byte(addr + 1 + i) != p[i])
+			break;
+	}
+
+	if (i == sizeof(g_params) &&
+			eeprom_read_byte(addr + PARAMS_SLOT - 1) == params_crc(g_params_seq))
+		return;
+
+	g_params_slot = (g_params_slot + 1) % PARAMS_SLOTS;
+	addr = params_slot(g_params_slot);
+	++g_params_seq;
+
+	EVENT(ev_params);
+
+	/* CRC goes last, torn record is invalid */
+	eeprom_update_byte(addr, g_params_seq);
+	for (i = 0; i < sizeof(g_params); ++i)
+		eeprom_update_byte(addr + 1 + i, p[i]);
+	eeprom_update_byte(addr + PARAMS_SLOT - 1, params_crc(g_params_seq));
 }
 
 
+static inline void load_params(void)
+{
+	byte *p = (byte *)&g_params;
+
+	g_params_slot = ring_newest(ADDR_PARAMS, PARAMS_SLOT, PARAMS_SLOTS);
+	g_params_seq = eeprom_read_byte(params_slot(g_params_slot));
+
+	/* Torn newest record, previous one is used. Without
+	 * either, the fields read as erased and get defaults. */
+	if (!params_read(g_params_slot) &&
+			!params_read((g_params_slot + PARAMS_SLOTS - 1) % PARAMS_SLOTS)) {
+		for (byte i = 0; i < sizeof(g_params); ++i)
+			p[i] = 0xff;
+	}
+}
+#elif !defined(FIXED_SETTINGS)
+/* Parameters at a fixed address, only changed bytes are written.
+ * Calibration and brightness keep their place from the firmware
+ * before struct params (brightness was a word, low byte first). */
 static void store_params(void)
 {
-	eeprom_write_word(ADDR_CALIBRATION, g_rtc_calib);
-	eeprom_write_word(ADDR_BRIGHNESS, g_brightness);
+	const byte *p = (const byte *)&g_params;
+
+	EVENT(ev_params);
+
+	for (byte i = 0; i < sizeof(g_params); ++i)
+		eeprom_update_byte(ADDR_PARAMS + i, p[i]);
+}
+
+
+static inline void load_params(void)
+{
+	byte *p = (byte *)&g_params;
+
+	for (byte i = 0; i < sizeof(g_params); ++i)
+		p[i] = eeprom_read_byte(ADDR_PARAMS + i);
+}
+#endif
+
+
+#ifdef FIXED_SETTINGS
+/* Set at build time, there's nothing to load or store */
+static inline void restore_params(byte warm)
+{
+	g_params.rtc_calib = RTC_CALIB;
+	g_params.brightness = BRIGHTNESS_LEVEL;
+	set_brightness();
+}
+#else
+/* Storing takes a few EEPROM writes (3.4 ms each), busy-waiting
+ * in a handler would lose ticks. Handlers only mark the change. */
+static inline void params_changed(void)
+{
+	g_params_pending = 1;
+}
+
+
+/* Called from the main loop. A change while the parameters are
+ * being written marks them again, the next store catches up. */
+static void params_task(void)
+{
+	if (!g_params_pending)
+		return;
+
+	g_params_pending = 0;
+	store_params();
 }
 
 
-static inline void restore_params(void)
+static inline void restore_params(byte warm)
 {
-	byte dataok = 1;
+	/* Parameters in RAM survived a warm reset */
+	if (warm) {
+		set_brightness();
+		return;
+	}
 
-	g_rtc_calib = eeprom_read_word(ADDR_CALIBRATION);
-	g_brightness = eeprom_read_word(ADDR_BRIGHNESS);
+	load_params();
 
-	if (g_rtc_calib > 999 || g_rtc_calib < -999) {
-		g_rtc_calib = RTC_CALIB;
-		dataok = 0;
+	/* Erased EEPROM, counters start at 0 */
+	if (g_params.brightness > 8) {
+		byte *p = (byte *)&g_params;
+
+		for (byte i = 0; i < sizeof(g_params); ++i)
+			p[i] = 0;
+		g_params.rtc_calib = RTC_CALIB;
+		g_params.brightness = BRIGHTNESS_LEVEL;
 	}
 
-	if (g_brightness > 8) {
-		g_brightness = 4;
-		dataok = 0;
+	if (g_params.rtc_calib > 999 || g_params.rtc_calib < -999)
+		g_params.rtc_calib = RTC_CALIB;
+
+#ifdef LEARN_CALIB
+	if (g_params.learn_corr > LEARN_MAX_CORR || g_params.learn_corr < -LEARN_MAX_CORR) {
+		g_params.learn_secs = 0;
+		g_params.learn_corr = 0;
 	}
+#endif
 
-	if (!dataok)
-		store_params();
+#ifdef SYNC
+	if (g_params.sync_master > 1)
+		g_params.sync_master = 0;
+#endif
 
+#ifdef EASING
+	if (g_params.ease >= EASE_CURVES)
+		g_params.ease = 0;
+#endif
+
+	store_params();
 	set_brightness();
 }
 
@@ -118,8 +768,8 @@ static inline void restore_params(void)
 
 static inline void brightness_inc(void)
 {
-	if (g_brightness < 8)
-		++g_brightness;
+	if (g_params.brightness < 8)
+		++g_params.brightness;
 
 	set_brightness();
 }
@@ -127,8 +777,8 @@ static inline void brightness_inc(void)
 
 static inline void brightness_dec(void)
 {
-	if (g_brightness > 0)
-		--g_brightness;
+	if (g_params.brightness > 0)
+		--g_params.brightness;
 
 	set_brightness();
 }
@@ -136,16 +786,17 @@ static inline void brightness_dec(void)
 
 static inline void calib_inc(void)
 {
-	if (g_rtc_calib < 999)
-		++g_rtc_calib;
+	if (g_params.rtc_calib < 999)
+		++g_params.rtc_calib;
 }
 
 
 static inline void calib_dec(void)
 {
-	if (g_rtc_calib > -999)
-		--g_rtc_calib;
+	if (g_params.rtc_calib > -999)
+		--g_params.rtc_calib;
 }
+#endif
 
 
 static void hours_inc(void)
@@ -170,7 +821,13 @@ static void minutes_inc(void)
 
 static byte button_check(byte which)
 {
+#ifdef UART
+	/* Button lines carry the USART */
+	(void)which;
+	return 0;
+#else
 	return !(PIND & (1 << which));
+#endif
 }
 
 
@@ -258,13 +915,128 @@ static void set_ramp(byte val)
 }
 
 
+/* Dots blink with the seconds, steady while the time is approximate */
+static byte dots_state(byte seconds)
+{
+#if defined(POWERFAIL) || defined(XTAL_FALLBACK)
+	if (g_time_set == TIME_APPROX)
+		return LED_DOTS;
+#endif
+
+	return seconds & 1 ? 0 : LED_DOTS;
+}
+
+
+/* Dots straight to the frame, without a ramp */
+static void dots_snap(byte dots)
+{
+	g_dots = dots;
+	g_led_on[DOTS_DIGIT] = (g_led_on[DOTS_DIGIT] & ~LED_DOTS) | dots;
+	g_led_rampup[DOTS_DIGIT] &= ~LED_DOTS;
+	g_led_rampdown[DOTS_DIGIT] &= ~LED_DOTS;
+}
+
+
+#ifdef BRIGHT_FADE
+/* One frame of a brightness change. Ramp in progress keeps going
+ * within the new span, finished one stays finished. */
+static inline void bright_step(void)
+{
+	byte done = g_rampcnt >= RAMP_MAX;
+
+	if (!g_bright_frames)
+		return;
+
+	--g_bright_frames;
+	g_bright_pos += g_bright_step;
+	OCR0B = g_bright_pos >> 8;
+
+	if (done || g_rampcnt > RAMP_MAX)
+		set_ramp(RAMP_MAX);
+}
+#endif
+
+
+#ifdef EASING
+/* Ramp-up brightness over the cross-fade, x/256 of the ramp span
+ * at i/EASE_STEPS of the duration: linear, ease-in-out (smoothstep),
+ * perceptual (inverse CIE lightness), exponential. Ramp-down gets
+ * the rest. */
+static const byte g_ease_lut[EASE_CURVES][EASE_STEPS] PROGMEM = {
+	{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 104, 112, 120,
+	  128, 135, 143, 151, 159, 167, 175, 183, 191, 199, 207, 215, 223, 231, 239, 247 },
+	{ 0, 1, 3, 6, 11, 17, 24, 31, 40, 49, 59, 70, 81, 92, 104, 116,
+	  128, 139, 151, 163, 174, 185, 196, 206, 215, 224, 231, 238, 244, 249, 252, 254 },
+	{ 0, 1, 2, 3, 4, 5, 7, 9, 11, 14, 17, 21, 25, 30, 35, 41,
+	  47, 54, 62, 70, 79, 89, 99, 111, 123, 136, 150, 165, 181, 198, 216, 235 },
+	{ 0, 0, 0, 1, 1, 1, 2, 2, 3, 4, 5, 6, 7, 9, 10, 12,
+	  15, 18, 22, 26, 31, 37, 44, 53, 63, 75, 90, 107, 127, 151, 180, 214 }
+};
+
+
+/* Every frame, position advances by a fixed step, so the duration
+ * doesn't depend on the brightness */
+static inline void ease_step(void)
+{
+	byte i;
+
+	if (g_rampcnt >= RAMP_MAX)
+		return;
+
+	g_ease_pos += EASE_STEP;
+	i = g_ease_pos >> 8;
+	if (i >= EASE_STEPS)
+		set_ramp(RAMP_MAX);
+	else
+		set_ramp(RAMP_MIN + ((pgm_read_byte(&g_ease_lut[g_params.ease][i]) * (RAMP_MAX - RAMP_MIN)) >> 8));
+}
+#endif
+
+
+#ifdef LOOKAHEAD
+/* Ticks from the ramp start until ramp-up and ramp-down segments
+ * are equally bright (OCR0A at the half of OCR0B). The ramp steps
+ * by RAMP_INC every 1024 Timer0 counts, 8.39 ticks per count, the
+ * first step comes half a frame (8 ticks) later on average. */
+static unsigned int ramp_lead(void)
+{
+#ifdef EASING
+	/* Curve's half way, the ramp goes on time on average */
+	byte i = 0;
+
+	while (pgm_read_byte(&g_ease_lut[g_params.ease][i]) < 128)
+		++i;
+
+	return i * EASE_STEP_TICKS;
+#else
+	unsigned int n = OCR0B / 2 - RAMP_MIN;
+
+	return (n << 3) + (n >> 2) + (n >> 3) + (n >> 6) - 8;
+#endif
+}
+
+
+/* Time to show the next second */
+static byte time_ahead(void)
+{
+	return g_time_set && g_subseconds >= (int)(RTC_HZ - ramp_lead());
+}
+#endif
+
+
 static void refresh_screen(int blanking)
 {
 	byte digit[4] = { LED_VOID, LED_VOID, LED_VOID, LED_VOID };
+	byte hours = g_hours, minutes = g_minutes;
+
+#ifdef LOOKAHEAD
+	g_ahead = 0;
+#endif
 
 	switch (g_mode) {
+#ifndef FIXED_SETTINGS
 		case mode_calib: {
-			int calib_tmp = g_rtc_calib;
+			int calib_tmp = g_params.rtc_calib;
 			if (calib_tmp < 0) {
 				digit[0] = 0xe;
 				calib_tmp = -calib_tmp;
@@ -282,188 +1054,2132 @@ static void refresh_screen(int blanking)
 
 		case mode_brightness:
 			digit[0] = 0xb;
-			digit[3] = g_brightness;
+			digit[3] = g_params.brightness;
+			break;
+#endif
+
+#ifdef SYNC
+		case mode_sync:
+			digit[0] = 5; /* S */
+			digit[3] = g_params.sync_master;
+			break;
+#endif
+
+#ifdef EASING
+		case mode_ease:
+			digit[0] = 0xe;
+			digit[3] = g_params.ease;
 			break;
+#endif
 
 		default:
 			if (!blanking) {
-				digit[0] = g_hours / 10;
-				digit[1] = g_hours % 10;
-				digit[2] = g_minutes / 10;
-				digit[3] = g_minutes % 10;
+#ifdef LOOKAHEAD
+				if (time_ahead()) {
+					g_ahead = 1;
+					g_dots = dots_state(g_seconds + 1);
+					if (g_seconds == 59 && ++minutes >= 60) {
+						minutes = 0;
+						if (++hours >= 24)
+							hours = 0;
+					}
+				}
+#endif
+				digit[0] = hours / 10;
+				digit[1] = hours % 10;
+				digit[2] = minutes / 10;
+				digit[3] = minutes % 10;
 			}
 			break;
 	}
 
 	for (byte i = 0; i < 4; ++i)
-		update_digit(i, decode7seg(digit[i]));
-
+		update_digit(i, decode7seg(digit[i]) | (i == DOTS_DIGIT ? g_dots : 0));
+
+#ifdef EASING
+	g_ease_pos = 0;
+#endif
+#if defined(POWERFAIL) || defined(SCHEDULE)
+	/* Stopped Timer0 would never finish a ramp, keeping the CPU
+	 * clock up, the changes show at once when it starts */
+	set_ramp(TCCR0B ? RAMP_MIN : RAMP_MAX);
+#else
 	set_ramp(RAMP_MIN);
+#endif
 }
 
 
-static void set_dots(int state)
+#ifdef CLOCK_SCALING
+/* CPU clock is divided down when there's little to do. Timer0
+ * prescaler follows, multiplex and PWM timing stays the same.
+ * Ramps and buttons get the full speed. */
+static byte clock_idle(void)
 {
-	PORTB &= ~(!state << 7);
-	PORTB |= !!state << 7;
+	return g_rampcnt >= RAMP_MAX &&
+#ifdef BRIGHT_FADE
+		!g_bright_frames &&
+#endif
+		g_button_state[0] == button_not_active && !g_button_presscnt[0] &&
+		g_button_state[1] == button_not_active && !g_button_presscnt[1];
 }
 
 
-static void button_action(byte which)
+/* Changing the clock garbles a byte on the line */
+static inline byte uart_quiet(void)
 {
-	/* switch()...case takes less flash space than funtion LUT */
-	switch (g_mode) {
-		case mode_calib:
-			if (!which)
-				calib_inc();
-			else
-				calib_dec();
-			break;
+#ifdef UART
+	return g_uart_quiet >= UART_QUIET;
+#else
+	return 1;
+#endif
+}
 
-		case mode_brightness:
-			if (!which)
-				brightness_inc();
-			else
-				brightness_dec();
-			break;
 
-		default:
-			if (!which)
-				minutes_inc();
-			else
-				hours_inc();
-			g_seconds = 0;
-			break;
+static void clock_scale(byte slow)
+{
+	CLKPR = 1 << CLKPCE;
+	CLKPR = slow ? CLOCK_SLOW : 0;
+	/* Timer0 stays stopped with the screen */
+	if (TCCR0B)
+		TCCR0B = slow ? T0_PRESCALER_SLOW : T0_PRESCALER;
+#ifdef UART
+	UBRRL = slow ? UART_UBRR(CLOCK_SLOW) : UART_UBRR(0);
+#endif
+	g_clock_slow = slow;
+}
+#endif
+
+
+#ifdef OSC_CALIB
+/* Internal RC oscillator trimmed against the crystal. Timer1
+ * counts CPU cycles over the first OSC_TICKS ticks of every
+ * second, OSCCAL moves by one step when the count is off by more
+ * than the tolerance. Window is dropped if the CPU clock prescaler
+ * changed meanwhile. */
+static void osc_calib(void)
+{
+	uint16_t cycles, expected;
+
+#ifdef XTAL_FALLBACK
+	/* No reference, measurement restarts with the next second */
+	if (g_fallback)
+		g_osc_cnt = OSC_TICKS + 1;
+#endif
+
+	if (g_osc_cnt > OSC_TICKS)
+		return;
+
+	if (!g_osc_cnt) {
+		g_osc_start = TCNT1;
+		g_osc_clkpr = CLKPR;
 	}
 
-	g_mode_timeout = 0;
+	if (g_osc_cnt++ < OSC_TICKS || CLKPR != g_osc_clkpr)
+		return;
+
+	cycles = TCNT1 - g_osc_start;
+	expected = OSC_CYCLES >> CLKPR;
+
+	if (cycles > expected + expected / OSC_TOLERANCE && OSCCAL > 0)
+		--OSCCAL;
+	else if (cycles < expected - expected / OSC_TOLERANCE && OSCCAL < 0x7f)
+		++OSCCAL;
 }
+#endif
 
 
-ISR(INT0_vect)
+#if defined(WARM_RESET) || defined(POWERFAIL)
+static byte chk_add(byte chk, byte val)
 {
-	byte update = 0, blanking = 0, btrigger = 0;
-
-	wdt_reset();
+	return ((chk << 1) | (chk >> 7)) ^ val;
+}
+#endif
 
-	/* Every second */
-	if (++g_subseconds >= RTC_HZ) {
-		g_subseconds -= RTC_HZ;
 
-		/* Increment clock */
-		if (++g_seconds >= 60) {
-			minutes_inc();
-			update = 1;
-		}
+#ifdef WARM_RESET
+/* Time state stays in SRAM over watchdog, brown-out and
+ * external resets. Checksum covers everything that changes
+ * at most once a second (parameters included), time_seal()
+ * follows every change. */
+static byte time_checksum(void)
+{
+	byte chk = WARM_MAGIC;
+
+	chk = chk_add(chk, g_seconds);
+	chk = chk_add(chk, g_minutes);
+	chk = chk_add(chk, g_hours);
+	chk = chk_add(chk, g_time_set);
+	chk = chk_add(chk, g_seconds_calib_cnt);
+	chk = chk_add(chk, g_seconds_calib_cnt >> 8);
+	for (byte i = 0; i < sizeof(g_params); ++i)
+		chk = chk_add(chk, ((const byte *)&g_params)[i]);
+
+	return chk;
+}
 
-		if (!g_time_set)
-			update = 1;
 
-		/* Handle dots and screen blinking when time is not set */
-		if (g_seconds & 1) {
-			set_dots(0);
-			if (!g_time_set)
-				blanking = 1;
-		}
-		else {
-			set_dots(1);
-		}
+static void time_seal(void)
+{
+	g_time_chk = time_checksum();
+}
 
-		/* Handle digital RTC calibration */
-		if (++g_seconds_calib_cnt >= RTC_HZ) {
-			g_subseconds += g_rtc_calib * 2;
-			g_seconds_calib_cnt = 0;
-		}
 
-		/* Handle special mode timeout */
-		if (g_mode != mode_normal && ++g_mode_timeout > 5) {
-			g_mode = mode_normal;
-			update = 1;
-			store_params();
-		}
+/* Returns 1 if the time survived the reset */
+static byte time_restore(byte cause)
+{
+	if (!(cause & (1 << PORF)) && g_time_chk == time_checksum() &&
+			g_seconds < 60 && g_minutes < 60 && g_hours < 24 &&
+			g_time_set <= TIME_APPROX && g_seconds_calib_cnt < RTC_HZ &&
+			g_subseconds > -RTC_HZ && g_subseconds < 2 * RTC_HZ) {
+		/* Ticks missed since the last one counted,
+		 * extra ones are caught up one per tick */
+		g_subseconds += WARM_STARTUP;
+		if (cause & (1 << WDRF))
+			g_subseconds += WARM_WDT;
+#ifdef XTAL_FALLBACK
+		/* Reset follows the second timeout, the first one interrupts */
+		if (cause & (1 << WDRF))
+			g_subseconds += WARM_WDT;
+#endif
+		return 1;
 	}
 
-	/* Handle buttons */
-	if ((btrigger = button_handle(0)) != 0) {
-		button_action(0);
-	}
-	else if ((btrigger = button_handle(1)) != 0) {
-		button_action(1);
+	g_subseconds = 0;
+	g_seconds_calib_cnt = 0;
+	g_seconds = 0;
+	g_minutes = 0;
+	g_time_set = 0;
+
+	return 0;
+}
+
+
+/* Counters stay in RAM over warm resets, they are stored once
+ * the clock has run for WARM_STORE seconds. A reset loop (e.g. a
+ * dead crystal) doesn't write the EEPROM on every start. */
+static void count_resets(byte cause)
+{
+	for (byte i = 0; i <= WDRF; ++i) {
+		if (cause & (1 << i))
+			++g_params.resets[i];
 	}
-	else if (g_button_state[0] == button_longpress &&
-			g_button_state[1] == button_longpress) {
-		if (++g_mode == mode_end) {
-			g_mode = mode_normal;
-			store_params();
-		}
 
-		g_button_state[0] = g_button_state[1] = button_lockup;
-		update = 1;
+	g_resets_store = WARM_STORE;
+	time_seal();
+}
+#endif
+
+
+#if defined(POWERFAIL) || defined(SCHEDULE)
+/* Timer0 stops with the screen, nothing is driven */
+static void screen_enable(byte on)
+{
+	if (on) {
+		DDRB = 0xff;
+		TCCR0B = T0_PRESCALER;
+#ifdef CLOCK_SCALING
+		clock_scale(0);
+#endif
+		refresh_screen(0);
 	}
-	else if (!(g_subseconds % (RTC_HZ / LONGPRESS_HZ))) {
-		btrigger = 1;
-		if (g_button_state[0] == button_longpress)
-			button_action(0);
-		else if (g_button_state[1] == button_longpress)
-			button_action(1);
-		else
-			btrigger = 0;
+	else {
+		TCCR0B = 0;
+		PORTB = 0;
+		DDRB = 0;
+		PORTD |= 0xf << 3;
 	}
+}
+#endif
 
-	if (btrigger) {
-		update = 1;
-		g_time_set = 1;
+
+#ifdef SCHEDULE
+/* Blank for a SCHED_OFF entry unless a button woke it up */
+static void sched_apply(void)
+{
+	byte blank = g_sched == SCHED_OFF && !g_sched_wake;
+
+#ifdef POWERFAIL
+	/* Screen is off, supply is failing */
+	if (g_pf_state >= pf_failing)
+		return;
+#endif
+
+	if (blank && TCCR0B) {
+		/* Frozen ramp or fade would keep the CPU clock up */
+		set_ramp(RAMP_MAX);
+#ifdef BRIGHT_FADE
+		g_bright_frames = 0;
+#endif
+		screen_enable(0);
+	}
+	else if (!blank && !TCCR0B) {
+		screen_enable(1);
 	}
 
-	if (update)
-		refresh_screen(blanking);
+	if (brightness_level() != g_bright_set)
+		set_brightness();
 }
 
 
-/* Select new digit */
-ISR(TIMER0_OVF_vect)
+/* Table on the EEPROM, a word per entry: minute of the day,
+ * level (0-8, SCHED_OFF) in bits 12-15, erased - unused. Handlers
+ * use the copy in RAM, an EEPROM read there could wait for a write
+ * of the main loop (or redirect it). */
+static inline void sched_load(void)
 {
-	byte t = PORTB & ~(0x7f);
-	byte dot = PORTB & 0x80;
+	for (byte i = 0; i < SCHED_ENTRIES; ++i)
+		g_sched_table[i] = eeprom_read_word(ADDR_SCHEDULE + i);
+}
 
-	/* Enable on and ramp-up segments, ramp-down stay disabled */
-	t |= ((g_led_on[g_curr_digit] |
-		g_led_rampup[g_curr_digit]) &
-		~g_led_rampdown[g_curr_digit]);
-	PORTB = (t & ~0x80) | dot;
 
-	PORTD &= ~(1 << (3 + g_curr_digit));
+/* Entry with the latest time up to now, or the last one of the day
+ * before */
+static void sched_update(void)
+{
+	int now = g_hours * 60 + g_minutes, best = 24 * 60, d;
+	uint16_t e;
+	byte level = 8;
+
+	for (byte i = 0; g_time_set && i < SCHED_ENTRIES; ++i) {
+		e = g_sched_table[i];
+		if ((e & SCHED_TIME) >= 24 * 60)
+			continue;
+
+		if ((d = now - (int)(e & SCHED_TIME)) < 0)
+			d += 24 * 60;
+		if (d < best) {
+			best = d;
+			level = e >> 12;
+		}
+	}
+
+	g_sched = level;
+	sched_apply();
 }
 
 
-/* Stop ramp-up, start ramp-down */
-ISR(TIMER0_COMPA_vect)
+/* First press lights a blank display up and does nothing else */
+static byte sched_wake(void)
 {
-	if (g_rampcnt < RAMP_MAX) {
-		byte dot = PORTB & 0x80;
-		/* Disable ramp-up segments, enable ramp-down */
-		byte t = PORTB & ~(g_led_rampup[g_curr_digit]);
-		PORTB = dot | ((t | g_led_rampdown[g_curr_digit]) & 0x7f);
+	if (TCCR0B)
+		return 0;
+
+	if (button_handle(0) | button_handle(1)) {
+		g_sched_wake = SCHED_WAKE;
+		sched_apply();
 	}
+
+	return 1;
+}
+#endif
+
+
+#ifdef POWERFAIL
+/* Power failure handling. Supply is sensed on PF_PIN before
+ * the diode feeding the bulk capacitor, so the MCU keeps
+ * running for a while after the sense goes low. Screen is
+ * turned off at once (it draws nearly all the current) and
+ * the main loop appends the time to a ring of EEPROM slots.
+ * While the MCU is still alive the slot's alive byte counts
+ * seconds since the save, which is the known part of the
+ * outage. The newest record follows the sequence numbers. */
+static byte *pf_slot(byte slot)
+{
+	return ADDR_PF_RING + slot * PF_SLOT;
 }
 
 
-/* Disable screen (brightness control) */
-ISR(TIMER0_COMPB_vect)
+static byte pf_checksum(const byte *rec)
 {
-	PORTB &= ~(0x7f);
-	PORTD |= 0xf << 3;
-	g_curr_digit = (g_curr_digit + 1) % 4;
+	byte chk = WARM_MAGIC;
 
-	if (!g_curr_digit)
-		set_ramp(g_rampcnt + RAMP_INC);
+	for (byte i = 0; i < 4; ++i)
+		chk = chk_add(chk, rec[i]);
+
+	return chk;
 }
 
 
-int main(void)
+#ifdef HOLDOVER
+/* Holdover on the bulk capacitor. CPU clock is divided down,
+ * the MCU sleeps in power-down through the high half of the
+ * 4060 period and is woken up by the low level on INT0, then
+ * waits in idle for the rising edge, which is counted as usual.
+ * Edges are detected only with the I/O clock running. T1 is a digit
+ * line, so the 2048 Hz output still wakes the MCU up 4096 times a
+ * second (about 0.6 mA), tens of uA need a slower 4060 output. */
+static void holdover_enter(void)
 {
-	wdt_enable(WDTO_250MS);
-	wdt_reset();
+	cli();
+	if (g_pf_state == pf_saved) {
+		CLKPR = 1 << CLKPCE;
+		CLKPR = HOLDOVER_CLKPS;
+		g_pf_state = pf_holdover;
+	}
+	sei();
+}
+
+
+static void holdover_exit(void)
+{
+	CLKPR = 1 << CLKPCE;
+	CLKPR = 0;
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	MCUCR |= (1 << ISC01) | (1 << ISC00);
+}
+
+
+/* Returns 1 on the low level wake-up, there's no tick to count */
+static byte holdover_wake(void)
+{
+	if (!(MCUCR & (1 << ISC00))) {
+		MCUCR |= (1 << ISC01) | (1 << ISC00);
+		EIFR = 1 << INTF0;
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		return 1;
+	}
+
+	MCUCR &= ~((1 << ISC01) | (1 << ISC00));
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+
+	return 0;
+}
+#endif
+
+
+static void powerfail_poll(void)
+{
+	if (!(PINA & (1 << PF_PIN))) {
+		g_pf_ok = 0;
+		if (g_pf_state < pf_failing && ++g_pf_cnt >= PF_DEBOUNCE) {
+			screen_enable(0);
+			g_pf_alive = 0;
+			g_pf_state = pf_failing;
+		}
+	}
+	else if (g_pf_state >= pf_failing) {
+		if (++g_pf_ok >= PF_RECOVER) {
+#ifdef HOLDOVER
+			holdover_exit();
+#endif
+			screen_enable(1);
+			g_pf_state = pf_recovered;
+#ifdef SCHEDULE
+			sched_apply();
+#endif
+		}
+	}
+	else {
+		g_pf_cnt = 0;
+	}
+}
+
+
+static void powerfail_save(void)
+{
+	byte rec[4], *slot;
+
+	cli();
+	rec[1] = g_hours;
+	rec[2] = g_minutes;
+	rec[3] = g_seconds;
+	sei();
+
+	if (!g_time_set)
+		return;
+
+	rec[0] = ++g_pf_seq;
+	g_pf_slot = (g_pf_slot + 1) % PF_SLOTS;
+	slot = pf_slot(g_pf_slot);
+
+	EVENT(ev_powerfail);
+
+	/* Checksum goes last, torn record is invalid */
+	for (byte i = 0; i < 4; ++i)
+		eeprom_update_byte(slot + i, rec[i]);
+	eeprom_update_byte(slot + 4, g_pf_alive);
+	eeprom_update_byte(slot + 5, pf_checksum(rec));
+	g_pf_record = 1;
+}
+
+
+/* Invalidates the newest record, time it holds is obsolete */
+static void powerfail_consume(void)
+{
+	byte *chk = pf_slot(g_pf_slot) + 5;
+
+	eeprom_write_byte(chk, ~eeprom_read_byte(chk));
+	g_pf_record = 0;
+}
+
+
+/* Called from the main loop, EEPROM writes take 3.4 ms each */
+static void powerfail_task(void)
+{
+	switch (g_pf_state) {
+		case pf_failing:
+			powerfail_save();
+			cli();
+			if (g_pf_state == pf_failing)
+				g_pf_state = pf_saved;
+			sei();
+			break;
+
+		case pf_saved:
+#ifdef HOLDOVER
+			holdover_enter();
+#else
+			if (g_pf_record)
+				eeprom_update_byte(pf_slot(g_pf_slot) + 4, g_pf_alive);
+#endif
+			break;
+
+#ifdef HOLDOVER
+		case pf_holdover:
+			/* Capacitor runs out eventually */
+			if (g_pf_alive >= PF_CHECKPOINT) {
+				g_pf_alive = 0;
+				powerfail_save();
+			}
+			break;
+#endif
+
+		case pf_recovered:
+			if (g_pf_record)
+				powerfail_consume();
+			g_pf_state = pf_none;
+			break;
+	}
+}
+
+
+static inline void powerfail_restore(void)
+{
+	byte rec[4], alive, *slot;
+
+	g_pf_slot = ring_newest(ADDR_PF_RING, PF_SLOT, PF_SLOTS);
+	slot = pf_slot(g_pf_slot);
+	for (byte i = 0; i < 4; ++i)
+		rec[i] = eeprom_read_byte(slot + i);
+	g_pf_seq = rec[0];
+
+	if (g_time_set || eeprom_read_byte(slot + 5) != pf_checksum(rec) ||
+			rec[1] >= 24 || rec[2] >= 60 || rec[3] >= 60)
+		return;
+
+	g_hours = rec[1];
+	g_minutes = rec[2];
+	g_seconds = rec[3];
+	g_subseconds = 0;
+	g_time_set = TIME_APPROX;
+
+	/* Outage lasted at least as long as the MCU was alive */
+	alive = eeprom_read_byte(slot + 4);
+	if (alive == 0xff)
+		alive = 0;
+	while (alive--) {
+		if (++g_seconds >= 60)
+			minutes_inc();
+	}
+
+	g_pf_record = 1;
+	powerfail_consume();
+}
+#endif
+
+
+#ifdef PPS_CALIB
+/* Automatic calibration from 1PPS reference. Every
+ * crystal tick between two pulses is counted, deviation
+ * from RTC_HZ is accumulated over PPS_WINDOW pulses.
+ * Calibration step is 2 ticks per 2048 seconds, so
+ * accumulated deviation scaled to 1024 seconds is
+ * the calibration value. Result is shown in calibration
+ * mode and stored on its timeout. */
+static byte pps_handle(void)
+{
+	byte level = PINA & (1 << PPS_PIN);
+	byte update = 0;
+
+	if (g_pps_interval != 0xffff)
+		++g_pps_interval;
+
+	if (level && !g_pps_level) {
+		if (g_pps_interval < RTC_HZ - PPS_TOLERANCE ||
+				g_pps_interval > RTC_HZ + PPS_TOLERANCE) {
+			/* First pulse or a glitch, start over */
+			g_pps_cnt = 0;
+			g_pps_dev = 0;
+		}
+		else {
+			g_pps_dev += g_pps_interval - RTC_HZ;
+
+			if (++g_pps_cnt >= PPS_WINDOW) {
+				long calib = -(long)g_pps_dev * 1024 / PPS_WINDOW;
+
+				if (calib <= 999 && calib >= -999) {
+					g_params.rtc_calib = calib;
+					g_mode = mode_calib;
+					EVENT(ev_mode | mode_calib);
+					g_mode_timeout = 0;
+					update = 1;
+				}
+
+				g_pps_cnt = 0;
+				g_pps_dev = 0;
+			}
+		}
+
+		g_pps_interval = 0;
+	}
+
+	g_pps_level = level;
+
+	return update;
+}
+#endif
+
+
+#ifdef LEARN_CALIB
+/* Calibration learnt from user's time corrections.
+ * Setting the time when it's not set (or a change bigger
+ * than LEARN_MAX_CORR, e.g. DST) starts an observation.
+ * Net correction of every later adjustment session (ended
+ * by 5 seconds without a button press) is accumulated and
+ * once the observation lasted LEARN_MIN_SECS, the drift is
+ * folded into the calibration and observation restarts.
+ * Drift of corr seconds over secs seconds takes
+ * corr * 2048 * 1024 / secs calibration steps. */
+static void learn_adjust(byte which)
+{
+	if (!g_learn_active) {
+		g_learn_active = 1;
+		g_learn_full = g_time_set != 1;
+	}
+
+	g_learn_adjust += (which ? 3600 : 60) - g_seconds;
+	g_learn_timeout = 0;
+}
+
+
+static void learn_commit(void)
+{
+	long adj = g_learn_adjust;
+
+	while (adj >= 43200)
+		adj -= 86400;
+
+	g_learn_active = 0;
+	g_learn_adjust = 0;
+
+	if (g_learn_full || adj > LEARN_MAX_CORR || adj < -LEARN_MAX_CORR ||
+			(g_params.learn_corr += adj) > LEARN_MAX_CORR || g_params.learn_corr < -LEARN_MAX_CORR) {
+		g_params.learn_secs = 0;
+		g_params.learn_corr = 0;
+	}
+	else if (g_params.learn_secs >= LEARN_MIN_SECS) {
+		long step = (long)g_params.learn_corr * 2048 * 1024 / (long)g_params.learn_secs;
+
+		if (step <= LEARN_MAX_STEP && step >= -LEARN_MAX_STEP) {
+			g_params.rtc_calib += step;
+			if (g_params.rtc_calib > 999)
+				g_params.rtc_calib = 999;
+			else if (g_params.rtc_calib < -999)
+				g_params.rtc_calib = -999;
+		}
+
+		g_params.learn_secs = 0;
+		g_params.learn_corr = 0;
+	}
+
+	params_changed();
+}
+
+
+static inline void learn_second(void)
+{
+	if (g_time_set)
+		++g_params.learn_secs;
+
+	if (g_learn_active && ++g_learn_timeout > 5)
+		learn_commit();
+}
+#endif
+
+
+#ifdef NMEA
+/* Time from a GPS module, NMEA 0183 on RXD and its 1PPS on PA0.
+ * Sentences are parsed as they stream in, only the time (and the
+ * RMC status) is kept. Time of a sentence is the time of the PPS
+ * edge before it, so the next edge (within a second) starts the
+ * following second at once. Clock then runs free for NMEA_INTERVAL
+ * seconds before it's disciplined again. */
+#define NMEA_ID(a, b, c) (((a) - 'A') << 10 | ((b) - 'A') << 5 | ((c) - 'A'))
+
+static byte nmea_digit(char c, byte *val)
+{
+	if (c < '0' || c > '9')
+		return 0;
+
+	*val = *val * 10 + c - '0';
+
+	return 1;
+}
+
+
+static byte nmea_hex(char c)
+{
+	return c <= '9' ? c - '0' : c - 'A' + 10;
+}
+
+
+static void nmea_field(char c)
+{
+	switch (g_nmea.field) {
+		case 0:
+			/* Talker ID is skipped, 5 bits per sentence ID letter */
+			if (g_nmea.pos >= 2)
+				g_nmea.id = (g_nmea.id << 5) | ((c - 'A') & 0x1f);
+			break;
+
+		case 1:
+			/* hhmmss.ss */
+			if (g_nmea.pos < 6 && !nmea_digit(c, &g_nmea.time[g_nmea.pos / 2]))
+				g_nmea.valid = 0;
+			break;
+
+		case 2:
+			if (g_nmea.id == NMEA_ID('R', 'M', 'C') && c == 'A')
+				g_nmea.fix = 1;
+			break;
+	}
+}
+
+
+/* Sentence with a valid checksum ended */
+static void nmea_sentence(void)
+{
+	if (!g_nmea.valid || g_nmea.time[0] >= 24 || g_nmea.time[1] >= 60 || g_nmea.time[2] >= 60)
+		return;
+
+	if (!(g_nmea.id == NMEA_ID('Z', 'D', 'A') ||
+			(g_nmea.id == NMEA_ID('R', 'M', 'C') && g_nmea.fix)))
+		return;
+
+	cli();
+	g_nmea_hours = g_nmea.time[0];
+	g_nmea_minutes = g_nmea.time[1];
+	g_nmea_seconds = g_nmea.time[2];
+	g_nmea_age = 0;
+	sei();
+}
+
+
+/* Returns 1 if the character belongs to a sentence */
+static byte nmea_char(char c)
+{
+	if (c == '$') {
+		byte *p = (byte *)&g_nmea;
+
+		for (byte i = 0; i < sizeof(g_nmea); ++i)
+			p[i] = 0;
+		g_nmea.active = 1;
+		g_nmea.valid = 1;
+		return 1;
+	}
+
+	if (!g_nmea.active)
+		return 0;
+
+	if (c == '\r' || c == '\n') {
+		if (g_nmea.star == 3 && g_nmea.chk == g_nmea.sum)
+			nmea_sentence();
+		g_nmea.active = 0;
+	}
+	else if (g_nmea.star) {
+		g_nmea.chk = (g_nmea.chk << 4) | nmea_hex(c);
+		if (++g_nmea.star > 3)
+			g_nmea.active = 0;
+	}
+	else if (c == '*') {
+		g_nmea.star = 1;
+	}
+	else {
+		g_nmea.sum ^= c;
+
+		if (c == ',') {
+			/* Address is 5 characters, time at least hhmmss */
+			if ((g_nmea.field == 0 && g_nmea.pos != 5) ||
+					(g_nmea.field == 1 && g_nmea.pos < 6))
+				g_nmea.valid = 0;
+			++g_nmea.field;
+			g_nmea.pos = 0;
+		}
+		else {
+			nmea_field(c);
+			if (g_nmea.pos < 0xff)
+				++g_nmea.pos;
+		}
+	}
+
+	return 1;
+}
+
+
+/* Called every tick before the time is counted */
+static byte nmea_pps(void)
+{
+	byte level = PINA & (1 << PPS_PIN), update = 0;
+
+	if (g_nmea_age < RTC_HZ)
+		++g_nmea_age;
+
+	if (level && !g_nmea_level && g_nmea_age < RTC_HZ && !g_nmea_wait) {
+		/* Counting this tick rolls the second over */
+		g_hours = g_nmea_hours;
+		g_minutes = g_nmea_minutes;
+		g_seconds = g_nmea_seconds;
+		g_subseconds = RTC_HZ - 1;
+		g_seconds_calib_cnt = 0;
+		g_time_set = 1;
+		g_nmea_age = RTC_HZ;
+		g_nmea_wait = NMEA_INTERVAL;
+		update = 1;
+	}
+
+	g_nmea_level = level;
+
+	return update;
+}
+#endif
+
+
+#ifdef SYNC
+/* Clocks kept in step over a shared open drain line (PA1, pulled
+ * up), one of them is the master (set in the sync mode). With
+ * every minute the master pulls the line low for a marker, then
+ * sends the minute of the day (11 bits, MSB first, even parity
+ * bit last), a pulse per slot, short for 0, long for 1. Followers
+ * poll the line every tick. Marker less than a second off moves
+ * the subseconds only, a valid frame that doesn't match sets the
+ * time. Drift seen at the markers over a calibration period
+ * (RTC_HZ seconds), less the calibration applied once in it, is
+ * the crystal's own: d ticks over s seconds take -d * 1024 / s
+ * calibration steps. Changes by a step are noise, not stored. */
+static void sync_line(byte low)
+{
+	if (low) {
+		PORTA &= ~(1 << SYNC_PIN);
+		DDRA |= 1 << SYNC_PIN;
+	}
+	else {
+		DDRA &= ~(1 << SYNC_PIN);
+		PORTA |= 1 << SYNC_PIN;
+	}
+}
+
+
+static byte sync_parity(uint16_t val)
+{
+	byte p = 0;
+
+	for (; val; val >>= 1)
+		p ^= val & 1;
+
+	return p;
+}
+
+
+/* Master, called with every tick after it's counted */
+static void sync_send(void)
+{
+	byte pos;
+
+	if (!g_sync.tx || !g_params.sync_master) {
+		sync_line(0);
+		return;
+	}
+
+	pos = SYNC_FRAME - g_sync.tx--;
+
+	if (!(pos % SYNC_SLOT)) {
+		if (!pos) {
+			g_sync.low = SYNC_MARK;
+		}
+		else {
+			g_sync.low = g_sync.data & (1 << (SYNC_BITS - 1)) ? SYNC_ONE : SYNC_ZERO;
+			g_sync.data <<= 1;
+		}
+		sync_line(1);
+	}
+	else if (pos % SYNC_SLOT == g_sync.low) {
+		sync_line(0);
+	}
+}
+
+
+/* Master, the minute has just started */
+static inline void sync_start(void)
+{
+	uint16_t val = g_hours * 60 + g_minutes;
+
+	if (!g_params.sync_master || !g_time_set)
+		return;
+
+	g_sync.data = (val << 1) | sync_parity(val);
+	g_sync.tx = SYNC_FRAME;
+}
+
+
+static void sync_calib(void)
+{
+	long calib = -(g_sync.drift - 2 * g_params.rtc_calib) * 1024 / (g_sync.minutes * 60L);
+
+	if (calib > 999)
+		calib = 999;
+	else if (calib < -999)
+		calib = -999;
+
+	if (calib >= g_params.rtc_calib - 1 && calib <= g_params.rtc_calib + 1)
+		return;
+
+	g_params.rtc_calib = calib;
+	params_changed();
+}
+
+
+/* Follower, the master's minute has just started. Counting this
+ * tick should roll the minute over. */
+static void sync_marker(void)
+{
+	long d = (long)g_seconds * RTC_HZ + g_subseconds + 1;
+
+	if (d >= 30L * RTC_HZ)
+		d -= 60L * RTC_HZ;
+
+	g_sync.far = d <= -RTC_HZ || d >= RTC_HZ;
+	g_sync.cnt = 0;
+	g_sync.bits = SYNC_BITS + 1;
+
+	if (g_sync.far || g_sync.age < 59 || g_sync.age > 61) {
+		/* Time set or markers missed, wait for the next period */
+		g_sync.run = 0;
+		g_sync.start = 0;
+	}
+	else {
+		g_subseconds -= d;
+
+		if (g_sync.run) {
+			g_sync.drift += d;
+			++g_sync.minutes;
+		}
+
+		/* Period ends with the first marker after the calibration
+		 * was applied, next one starts after the EEPROM write */
+		if (g_sync.start) {
+			g_sync.run = 1;
+			g_sync.start = 0;
+			g_sync.applied = 0;
+			g_sync.drift = 0;
+			g_sync.minutes = 0;
+		}
+		else if (g_sync.applied) {
+			if (g_sync.run)
+				sync_calib();
+			g_sync.run = 0;
+			g_sync.start = 1;
+		}
+	}
+
+	g_sync.age = 0;
+}
+
+
+/* Follower, frame received. Returns 1 if the time was set. */
+static byte sync_frame(void)
+{
+	uint16_t val = g_sync.data >> 1;
+	byte h = val / 60, m = val % 60;
+
+	if (sync_parity(g_sync.data) || h >= 24)
+		return 0;
+
+	if (!g_sync.far && h == g_hours && m == g_minutes && g_time_set == 1)
+		return 0;
+
+	/* Counting this tick puts the time cnt ticks after the marker */
+	g_hours = h;
+	g_minutes = m;
+	g_seconds = 0;
+	g_subseconds = g_sync.cnt - 1;
+	g_time_set = 1;
+#ifdef WARM_RESET
+	time_seal();
+#endif
+
+	return 1;
+}
+
+
+/* Follower, called with every tick before it's counted */
+static byte sync_receive(void)
+{
+	byte level = PINA & (1 << SYNC_PIN), update = 0;
+
+	if (g_params.sync_master)
+		return 0;
+
+	if (g_sync.cnt < 0xffff)
+		++g_sync.cnt;
+
+	if (!level) {
+		if (g_sync.level) {
+			if (g_sync.idle >= SYNC_IDLE)
+				sync_marker();
+			g_sync.low = 0;
+		}
+
+		/* Stuck line spoils the frame */
+		if (++g_sync.low >= SYNC_SLOT)
+			g_sync.bits = 0;
+		g_sync.idle = 0;
+	}
+	else {
+		if (!g_sync.level && g_sync.bits) {
+			/* Pulse ended, the first one is the marker */
+			if (--g_sync.bits < SYNC_BITS)
+				g_sync.data = (g_sync.data << 1) | (g_sync.low > (SYNC_ZERO + SYNC_ONE) / 2);
+			if (!g_sync.bits)
+				update = sync_frame();
+		}
+
+		if (g_sync.idle < 0xff)
+			++g_sync.idle;
+	}
+
+	g_sync.level = level;
+
+	return update;
+}
+#endif
+
+
+#ifdef EVENT_TRACE
+/* Position kept over a reset, random after power-up. One off the
+ * record boundary would write past the ring, start over then. */
+static byte event_checked(byte pos)
+{
+	return pos < EVENT_SIZE && pos % 3 == 0 ? pos : 0;
+}
+
+
+/* Watchdog reset freezes the ring until event_task() copies it
+ * to EEPROM (SRAM can't be read over ISP), a reset before that
+ * keeps it frozen */
+static void event_start(byte cause)
+{
+	byte pos = g_event_pos;
+
+	if (cause & (1 << WDRF)) {
+		if (pos != EVENT_FROZEN)
+			g_event_from = event_checked(pos);
+		g_event_pos = EVENT_FROZEN;
+		return;
+	}
+
+	g_event_pos = event_checked(pos);
+	event_log(ev_start | (cause & 0x0f));
+}
+
+
+/* Called from the main loop, the copy goes oldest event first,
+ * EEPROM writes take 3.4 ms each */
+static void event_task(void)
+{
+	byte pos = event_checked(g_event_from);
+
+	if (g_event_pos != EVENT_FROZEN)
+		return;
+
+	for (byte i = 0; i < EVENT_SIZE; ++i) {
+		eeprom_update_byte(ADDR_EVENTS + i, g_events[pos]);
+		if (++pos >= EVENT_SIZE)
+			pos = 0;
+	}
+
+	cli();
+	g_event_pos = 0;
+	event_log(ev_start | (1 << WDRF));
+	sei();
+}
+#endif
+
+
+#ifdef UART
+/* Serial commands, 9600 8N1 on the button lines (PD0 RXD, PD1 TXD),
+ * so the buttons can't be used. Interrupts only move bytes between
+ * the USART and the rings, lines are parsed in the main loop.
+ * Commands end with CR or LF, each one is answered with a line:
+ * T         - read time, "T hh:mm:ss",
+ * Thhmmss   - set time, the second starts at once,
+ * C[+-n]    - read or set calibration, "C +n",
+ * B[n]      - read or set brightness, "B n",
+ * S[n]      - read or set the sync role (1 - master), "S n",
+ * F[n]      - read or set the cross-fade curve, "F n",
+ * P[i[ hhmm l]] - read the schedule or set (clear) its entry i,
+ *             l is the level or '-' for a blank display, "P" and
+ *             " hhmm:l" for each entry, " -" if unused,
+ * D         - diagnostics, "D" and a letter with a value for each
+ *             item: s - time set, o - OSCCAL, P, E, B, W - resets,
+ *             f - power failure state, x - crystal fallback,
+ *             l - light (discharge ticks), L - its level,
+ * E         - events saved by the last watchdog reset, "E" and
+ *             3 bytes per event in hex, oldest first,
+ * U         - "U" and a watchdog reset into the serial loader
+ *             (boot.c, with LOADER), the uploader holds RXD low,
+ * anything else is answered with "?". New calibration and
+ * brightness are shown and stored as if set with the buttons. */
+ISR(USART_RX_vect)
+{
+	byte status = UCSRA, c = UDR;
+	byte head = (g_uart_rx_head + 1) & (UART_RING - 1);
+
+	EVENT(ev_uart_rx);
+
+	/* Garbled byte spoils the line */
+	if (status & ((1 << FE) | (1 << DOR)))
+		c = 0;
+
+	if (head != g_uart_rx_tail) {
+		g_uart_rx[g_uart_rx_head] = c;
+		g_uart_rx_head = head;
+	}
+
+	g_uart_quiet = 0;
+}
+
+
+ISR(USART_UDRE_vect)
+{
+	byte tail = g_uart_tx_tail;
+
+	EVENT(ev_uart_udre);
+	UDR = g_uart_tx[tail];
+	g_uart_tx_tail = tail = (tail + 1) & (UART_RING - 1);
+	if (tail == g_uart_tx_head)
+		UCSRB &= ~(1 << UDRIE);
+
+	g_uart_quiet = 0;
+}
+
+
+static void uart_put(char c)
+{
+	byte head = (g_uart_tx_head + 1) & (UART_RING - 1);
+
+	/* Ring is full, wait for a byte to go */
+	while (head == g_uart_tx_tail)
+		sleep_cpu();
+
+	g_uart_tx[g_uart_tx_head] = c;
+	g_uart_tx_head = head;
+	UCSRB |= 1 << UDRIE;
+}
+
+
+static void uart_dec(unsigned int val, byte digits)
+{
+	char buf[5];
+	byte n = 0;
+
+	do {
+		buf[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val || n < digits);
+
+	while (n)
+		uart_put(buf[--n]);
+}
+
+
+#ifdef EVENT_TRACE
+static void uart_hex(byte val)
+{
+	for (byte i = 0; i < 2; ++i, val <<= 4) {
+		byte d = val >> 4;
+
+		uart_put(d < 10 ? '0' + d : 'a' - 10 + d);
+	}
+}
+#endif
+
+
+static void uart_field(char name, unsigned int val)
+{
+	uart_put(' ');
+	uart_put(name);
+	uart_dec(val, 1);
+}
+
+
+static void uart_eol(void)
+{
+	uart_put('\r');
+	uart_put('\n');
+}
+
+
+/* Decimal number with an optional sign, returns 0 if malformed */
+static byte uart_number(const char *s, int *val)
+{
+	byte neg = 0, n;
+
+	if (*s == '+' || *s == '-')
+		neg = *s++ == '-';
+
+	for (*val = 0, n = 0; s[n]; ++n) {
+		if (s[n] < '0' || s[n] > '9' || n >= 4)
+			return 0;
+		*val = *val * 10 + s[n] - '0';
+	}
+
+	if (neg)
+		*val = -*val;
+
+	return n != 0;
+}
+
+
+static byte uart_pair(const char *s)
+{
+	if (s[0] < '0' || s[0] > '9' || s[1] < '0' || s[1] > '9')
+		return 0xff;
+
+	return (s[0] - '0') * 10 + s[1] - '0';
+}
+
+
+static byte uart_set_time(const char *s)
+{
+	byte h = uart_pair(s), m = uart_pair(s + 2), sec = uart_pair(s + 4);
+
+	if (s[6] || h >= 24 || m >= 60 || sec >= 60)
+		return 0;
+
+	cli();
+	g_hours = h;
+	g_minutes = m;
+	g_seconds = sec;
+	g_subseconds = 0;
+	g_time_set = 1;
+	refresh_screen(0);
+#ifdef WARM_RESET
+	time_seal();
+#endif
+#ifdef SCHEDULE
+	sched_update();
+#endif
+	sei();
+
+	return 1;
+}
+
+
+#ifdef SCHEDULE
+/* "i hhmm l" sets entry i, "i" alone clears it */
+static byte uart_sched(const char *s)
+{
+	byte i = s[0] - '0', h, m, level = SCHED_OFF;
+	uint16_t e = 0xffff;
+
+	if (i >= SCHED_ENTRIES)
+		return 0;
+
+	if (s[1]) {
+		h = uart_pair(s + 2);
+		m = uart_pair(s + 4);
+		if (s[1] != ' ' || h >= 24 || m >= 60 || s[6] != ' ' || s[8])
+			return 0;
+		if (s[7] != '-' && (level = s[7] - '0') > 8)
+			return 0;
+		e = (uint16_t)level << 12 | (h * 60 + m);
+	}
+
+	eeprom_update_word(ADDR_SCHEDULE + i, e);
+
+	cli();
+	g_sched_table[i] = e;
+	sched_update();
+	sei();
+
+	return 1;
+}
+#endif
+
+
+/* Value is shown in its mode, stored on the mode timeout */
+static void uart_set_mode(byte mode)
+{
+	cli();
+	g_mode = mode;
+	EVENT(ev_mode | mode);
+	g_mode_timeout = 0;
+	set_brightness();
+	refresh_screen(0);
+#ifdef WARM_RESET
+	time_seal();
+#endif
+	sei();
+}
+
+
+#ifdef LOADER
+/* Answer goes out first, interrupts stay off until the reset */
+static void uart_loader(void)
+{
+	while (g_uart_tx_tail != g_uart_tx_head)
+		sleep_cpu();
+
+	cli();
+#ifdef WARM_RESET
+	/* Time spent in the loader is unknown */
+	++g_time_chk;
+#endif
+	wdt_enable(WDTO_15MS);
+	while (1)
+		sleep_cpu();
+}
+#endif
+
+
+static void uart_command(void)
+{
+	const char *arg = g_uart_line + 1;
+	byte h, m, s;
+	int val;
+
+	switch (g_uart_line[0]) {
+		case 'T':
+			if (*arg && !uart_set_time(arg))
+				break;
+
+			cli();
+			h = g_hours;
+			m = g_minutes;
+			s = g_seconds;
+			sei();
+
+			uart_put('T');
+			uart_put(' ');
+			uart_dec(h, 2);
+			uart_put(':');
+			uart_dec(m, 2);
+			uart_put(':');
+			uart_dec(s, 2);
+			uart_eol();
+			return;
+
+		case 'C':
+			if (*arg) {
+				if (!uart_number(arg, &val) || val > 999 || val < -999)
+					break;
+				cli();
+				g_params.rtc_calib = val;
+				sei();
+				uart_set_mode(mode_calib);
+			}
+
+			cli();
+			val = g_params.rtc_calib;
+			sei();
+
+			uart_put('C');
+			uart_put(' ');
+			uart_put(val < 0 ? '-' : '+');
+			uart_dec(val < 0 ? -val : val, 1);
+			uart_eol();
+			return;
+
+		case 'B':
+			if (*arg) {
+				if (!uart_number(arg, &val) || val > 8 || val < 0)
+					break;
+				g_params.brightness = val;
+				uart_set_mode(mode_brightness);
+			}
+
+			uart_put('B');
+			uart_put(' ');
+			uart_dec(g_params.brightness, 1);
+			uart_eol();
+			return;
+
+#ifdef SYNC
+		case 'S':
+			if (*arg) {
+				if (!uart_number(arg, &val) || val > 1 || val < 0)
+					break;
+				g_params.sync_master = val;
+				uart_set_mode(mode_sync);
+			}
+
+			uart_put('S');
+			uart_put(' ');
+			uart_dec(g_params.sync_master, 1);
+			uart_eol();
+			return;
+#endif
+
+#ifdef EASING
+		case 'F':
+			if (*arg) {
+				if (!uart_number(arg, &val) || val >= EASE_CURVES || val < 0)
+					break;
+				g_params.ease = val;
+				uart_set_mode(mode_ease);
+			}
+
+			uart_put('F');
+			uart_put(' ');
+			uart_dec(g_params.ease, 1);
+			uart_eol();
+			return;
+#endif
+
+#ifdef SCHEDULE
+		case 'P':
+			if (*arg && !uart_sched(arg))
+				break;
+
+			uart_put('P');
+			for (byte i = 0; i < SCHED_ENTRIES; ++i) {
+				uint16_t e = g_sched_table[i];
+
+				uart_put(' ');
+				if ((e & SCHED_TIME) >= 24 * 60) {
+					uart_put('-');
+					continue;
+				}
+				uart_dec((e & SCHED_TIME) / 60, 2);
+				uart_dec((e & SCHED_TIME) % 60, 2);
+				uart_put(':');
+				uart_put(e >> 12 == SCHED_OFF ? '-' : '0' + (e >> 12));
+			}
+			uart_eol();
+			return;
+#endif
+
+		case 'D':
+			if (*arg)
+				break;
+
+			uart_put('D');
+			uart_field('s', g_time_set);
+			uart_field('o', OSCCAL);
+#ifdef WARM_RESET
+			uart_field('P', g_params.resets[PORF]);
+			uart_field('E', g_params.resets[EXTRF]);
+			uart_field('B', g_params.resets[BORF]);
+			uart_field('W', g_params.resets[WDRF]);
+#endif
+#ifdef POWERFAIL
+			uart_field('f', g_pf_state);
+#endif
+#ifdef XTAL_FALLBACK
+			uart_field('x', g_fallback);
+#endif
+#ifdef LIGHT_SENSE
+			uart_field('l', g_light_avg >> 8);
+			uart_field('L', g_light);
+#endif
+			uart_eol();
+			return;
+
+#ifdef EVENT_TRACE
+		case 'E':
+			if (*arg)
+				break;
+
+			uart_put('E');
+			uart_put(' ');
+			for (h = 0; h < EVENT_SIZE; ++h)
+				uart_hex(eeprom_read_byte(ADDR_EVENTS + h));
+			uart_eol();
+			return;
+#endif
+
+#ifdef LOADER
+		case 'U':
+			if (*arg)
+				break;
+
+			uart_put('U');
+			uart_eol();
+			uart_loader();
+			return;
+#endif
+	}
+
+	uart_put('?');
+	uart_eol();
+}
+
+
+/* Called from the main loop, collects lines from the RX ring */
+static void uart_task(void)
+{
+	while (g_uart_rx_tail != g_uart_rx_head) {
+		char c = g_uart_rx[g_uart_rx_tail];
+
+		g_uart_rx_tail = (g_uart_rx_tail + 1) & (UART_RING - 1);
+
+#ifdef NMEA
+		if (nmea_char(c))
+			continue;
+#endif
+
+		if (c == '\r' || c == '\n') {
+			if (g_uart_len) {
+				/* Too long line is answered with an error */
+				g_uart_line[g_uart_len < UART_LINE ? g_uart_len : 0] = 0;
+				uart_command();
+			}
+			g_uart_len = 0;
+		}
+		else {
+			if (g_uart_len < UART_LINE - 1)
+				g_uart_line[g_uart_len] = c;
+			if (g_uart_len < UART_LINE)
+				++g_uart_len;
+		}
+	}
+}
+#endif
+
+
+#ifdef TELEMETRY
+/* Telemetry frame, every second after the text answers:
+ * TEL_SYNC, sequence number, longest INT0 handler (CPU cycles, LSB
+ * first), missed ticks, Timer0 interrupts (LSB first), ramp, mode,
+ * free stack bytes and CRC-8 of all but TEL_SYNC. Counters start
+ * over with every frame. Frame is dropped if the TX ring can't take
+ * all of it, the sequence number shows the gap. */
+#ifdef __AVR__
+extern byte __heap_start; /* End of static data */
+
+/* Stack is painted at start-up, the bytes still untouched above
+ * static data are the low-water mark */
+static void stack_paint(void)
+{
+	byte *p = &__heap_start;
+
+	while (p < (byte *)SP)
+		*p++ = STACK_PAINT;
+}
+
+
+static byte stack_free(void)
+{
+	const byte *p = &__heap_start;
+	byte n = 0;
+
+	while (*p++ == STACK_PAINT && n < 0xff)
+		++n;
+
+	return n;
+}
+#else
+/* Simulator runs the firmware on the host stack */
+#define stack_paint()
+#define stack_free() 0
+#endif
+
+
+/* Called at the end of every crystal tick. Tick gaps over one and
+ * a half tick are missed ticks, Timer1 counts CPU cycles and wraps
+ * after 16 ticks (at 8 MHz) */
+static void telemetry_tick(uint16_t start)
+{
+	uint16_t d = TCNT1 - start, tick = TEL_TICK >> CLKPR, gap = start - g_tel.last;
+	byte n = 0;
+
+	if (d > g_tel.int0_max)
+		g_tel.int0_max = d;
+
+	if (g_tel.armed) {
+		while (gap > tick + tick / 2 && n < 15) {
+			gap -= tick;
+			++n;
+		}
+		g_tel.missed = g_tel.missed + n < 0xff ? g_tel.missed + n : 0xff;
+	}
+
+	g_tel.last = start;
+	/* Timer1 stops in power-down */
+	g_tel.armed = !(MCUCR & (1 << SM0));
+}
+
+
+/* Called from the main loop */
+static void telemetry_task(void)
+{
+	byte frame[TEL_FRAME], i, crc = 0;
+
+	if (!g_tel.due)
+		return;
+
+	cli();
+	g_tel.due = 0;
+	frame[0] = TEL_SYNC;
+	frame[1] = g_tel.seq++;
+	frame[2] = g_tel.int0_max & 0xff;
+	frame[3] = g_tel.int0_max >> 8;
+	frame[4] = g_tel.missed;
+	frame[5] = g_tel.t0 & 0xff;
+	frame[6] = g_tel.t0 >> 8;
+	frame[7] = g_rampcnt;
+	frame[8] = g_mode;
+	g_tel.int0_max = 0;
+	g_tel.missed = 0;
+	g_tel.t0 = 0;
+	sei();
+
+	frame[9] = stack_free();
+	for (i = 1; i < TEL_FRAME - 1; ++i)
+		crc = _crc8_ccitt_update(crc, frame[i]);
+	frame[TEL_FRAME - 1] = crc;
+
+	if (((g_uart_tx_tail - g_uart_tx_head - 1) & (UART_RING - 1)) < TEL_FRAME)
+		return;
+
+	for (i = 0; i < TEL_FRAME; ++i)
+		uart_put(frame[i]);
+}
+#endif
+
+
+static void button_action(byte which)
+{
+	EVENT(ev_button | which);
+
+	/* switch()...case takes less flash space than funtion LUT */
+	switch (g_mode) {
+#ifndef FIXED_SETTINGS
+		case mode_calib:
+			if (!which)
+				calib_inc();
+			else
+				calib_dec();
+			break;
+
+		case mode_brightness:
+			if (!which)
+				brightness_inc();
+			else
+				brightness_dec();
+			break;
+#endif
+
+#ifdef SYNC
+		case mode_sync:
+			g_params.sync_master = !g_params.sync_master;
+			break;
+#endif
+
+#ifdef EASING
+		case mode_ease:
+			if (++g_params.ease >= EASE_CURVES)
+				g_params.ease = 0;
+			break;
+#endif
+
+		default:
+#ifdef LEARN_CALIB
+			learn_adjust(which);
+#endif
+			if (!which)
+				minutes_inc();
+			else
+				hours_inc();
+			g_seconds = 0;
+			break;
+	}
+
+	g_mode_timeout = 0;
+}
+
+
+#ifdef LIGHT_SENSE
+/* Discharge ticks where the level goes up: level i + 1 below [i],
+ * at 1.5, 3, 6, 12, 25, 50, 100 and 200 lux with 1 uF and GL5528 */
+static const byte g_light_lut[8] PROGMEM = { 106, 66, 41, 25, 15, 10, 6, 4 };
+
+
+/* Level follows the filtered time one step per sample, once it's
+ * 1/8 past the threshold, so it doesn't flicker between two */
+static void light_sample(byte t)
+{
+	byte level = g_light;
+	unsigned int th;
+
+	g_light_avg += ((unsigned int)t << 6) - (g_light_avg >> 2);
+
+	if (level < 8) {
+		th = pgm_read_byte(&g_light_lut[level]) << 8;
+		if (g_light_avg < th - (th >> 3))
+			++level;
+	}
+
+	if (level == g_light && level > 0) {
+		th = pgm_read_byte(&g_light_lut[level - 1]) << 8;
+		if (g_light_avg > th + (th >> 3))
+			--level;
+	}
+
+	g_light = level;
+	if (brightness_level() != g_bright_set)
+		set_brightness();
+}
+
+
+/* Ambient light without ADC: the pin charges the capacitor (through
+ * a series resistor) for LIGHT_CHARGE ticks, then lets the LDR
+ * discharge it and checks every tick for logic low. Darker is
+ * slower, up to LIGHT_MAX ticks. Analog comparator and input capture
+ * pins are display lines. */
+static void light_tick(void)
+{
+	unsigned int phase = g_subseconds & (LIGHT_PERIOD - 1);
+
+	if (g_light_cnt) {
+		if (!(PINA & (1 << LIGHT_PIN)) || g_light_cnt == LIGHT_MAX) {
+			light_sample(g_light_cnt);
+			g_light_cnt = 0;
+		}
+		else {
+			++g_light_cnt;
+		}
+	}
+
+	if (!phase) {
+		g_light_cnt = 0;
+		PORTA |= 1 << LIGHT_PIN;
+		DDRA |= 1 << LIGHT_PIN;
+	}
+	else if (phase == LIGHT_CHARGE) {
+		DDRA &= ~(1 << LIGHT_PIN);
+		PORTA &= ~(1 << LIGHT_PIN);
+		g_light_cnt = 1;
+	}
+}
+#endif
+
+
+/* One RTC tick, from the crystal or from the fallback timebase */
+static void rtc_tick(byte update)
+{
+	byte blanking = 0, btrigger = 0, next = 0, dots;
+
+#ifdef SYNC
+	update |= sync_receive();
+#endif
+
+#ifdef POWERFAIL
+	powerfail_poll();
+#endif
+
+	/* Every second */
+	if (++g_subseconds >= RTC_HZ) {
+		g_subseconds -= RTC_HZ;
+
+		/* Increment clock */
+		if (++g_seconds >= 60) {
+			minutes_inc();
+			next = 1;
+#ifdef SCHEDULE
+			sched_update();
+#endif
+		}
+
+		/* Handle dots and screen blinking when time is not set */
+		if (!g_time_set) {
+			update = 1;
+			if (g_seconds & 1)
+				blanking = 1;
+		}
+
+		dots = dots_state(g_seconds);
+		if (dots != g_dots) {
+#ifdef DOTS_FADE
+			g_dots = dots;
+			next = 1;
+#else
+			dots_snap(dots);
+#endif
+		}
+
+#ifdef LOOKAHEAD
+		/* Already on the screen */
+		if (g_ahead)
+			next = 0;
+		g_ahead = 0;
+#endif
+		update |= next;
+
+#ifdef POWERFAIL
+		if (g_pf_state >= pf_failing && g_pf_alive < 0xfe)
+			++g_pf_alive;
+#endif
+
+		/* Handle digital RTC calibration */
+		if (++g_seconds_calib_cnt >= RTC_HZ) {
+			g_subseconds += g_params.rtc_calib * 2;
+			g_seconds_calib_cnt = 0;
+#ifdef SYNC
+			g_sync.applied = 1;
+#endif
+		}
+
+#ifdef LEARN_CALIB
+		learn_second();
+#endif
+
+#ifdef OSC_CALIB
+		g_osc_cnt = 0;
+#endif
+
+#ifdef NMEA
+		if (g_nmea_wait)
+			--g_nmea_wait;
+#endif
+
+#ifdef TELEMETRY
+		g_tel.due = 1;
+#endif
+
+#ifdef SYNC
+		if (!g_seconds)
+			sync_start();
+		if (g_sync.age < 0xff)
+			++g_sync.age;
+#endif
+
+#ifdef SCHEDULE
+		if (g_sched_wake && !--g_sched_wake)
+			sched_apply();
+#endif
+
+#ifndef FIXED_SETTINGS
+		/* Handle special mode timeout */
+		if (g_mode != mode_normal && ++g_mode_timeout > 5) {
+			g_mode = mode_normal;
+			EVENT(ev_mode | mode_normal);
+			update = 1;
+			params_changed();
+		}
+#endif
+
+#ifdef WARM_RESET
+		if (g_resets_store && !--g_resets_store)
+			params_changed();
+		time_seal();
+#endif
+	}
+
+#ifdef XTAL_FALLBACK
+	/* Fault indicator, fast blinking dots */
+	if (g_fallback)
+		dots_snap(g_subseconds & (RTC_HZ / 8) ? LED_DOTS : 0);
+#endif
+
+#ifdef SYNC
+	sync_send();
+#endif
+
+#ifdef POWERFAIL
+	/* Screen is off, supply is failing */
+	if (g_pf_state >= pf_failing)
+		return;
+#endif
+
+#ifdef OSC_CALIB
+	osc_calib();
+#endif
+
+#ifdef LIGHT_SENSE
+	light_tick();
+#endif
+
+	/* Handle buttons */
+#ifdef SCHEDULE
+	if (sched_wake()) {
+	}
+	else
+#endif
+	if ((btrigger = button_handle(0)) != 0) {
+		button_action(0);
+	}
+	else if ((btrigger = button_handle(1)) != 0) {
+		button_action(1);
+	}
+#ifndef FIXED_SETTINGS
+	else if (g_button_state[0] == button_longpress &&
+			g_button_state[1] == button_longpress) {
+		if (++g_mode == mode_end) {
+			g_mode = mode_normal;
+			params_changed();
+		}
+		EVENT(ev_mode | g_mode);
+
+		g_button_state[0] = g_button_state[1] = button_lockup;
+		update = 1;
+	}
+#endif
+	else if (!(g_subseconds % (RTC_HZ / LONGPRESS_HZ))) {
+		btrigger = 1;
+		if (g_button_state[0] == button_longpress)
+			button_action(0);
+		else if (g_button_state[1] == button_longpress)
+			button_action(1);
+		else
+			btrigger = 0;
+	}
+
+	if (btrigger) {
+		update = 1;
+		g_time_set = 1;
+#ifdef WARM_RESET
+		time_seal();
+#endif
+#ifdef SCHEDULE
+		/* Time may have changed, display stays lit while in use */
+		if (g_sched_wake)
+			g_sched_wake = SCHED_WAKE;
+		sched_update();
+#endif
+	}
+
+#ifdef LOOKAHEAD
+	/* Next second goes up early if the minute or the fading dots change */
+#ifdef DOTS_FADE
+	if (!g_ahead && g_mode == mode_normal && time_ahead() &&
+			(g_seconds == 59 || dots_state(g_seconds + 1) != g_dots))
+#else
+	if (!g_ahead && g_mode == mode_normal && time_ahead() && g_seconds == 59)
+#endif
+		update = 1;
+#endif
+
+	if (update) {
+#if defined(LIGHT_SENSE) || defined(SCHEDULE)
+		/* Cap is off in the brightness mode, back on leaving it */
+		if (brightness_level() != g_bright_set)
+			set_brightness();
+#endif
+		refresh_screen(blanking);
+	}
+
+#ifdef UART
+	if (g_uart_quiet < UART_QUIET)
+		++g_uart_quiet;
+#endif
+
+#ifdef CLOCK_SCALING
+	if (clock_idle() != g_clock_slow && uart_quiet())
+		clock_scale(!g_clock_slow);
+#endif
+}
+
+
+#ifdef XTAL_FALLBACK
+/* Fallback timebase. Watchdog runs in interrupt and reset mode,
+ * its interrupt means there was no crystal tick for its timeout.
+ * Ticks are then generated by Timer1 compare B from the (trimmed)
+ * RC oscillator, the first crystal tick switches back and the
+ * time is marked approximate. Real hang still ends with a reset,
+ * the interrupt mode has to be re-enabled after each timeout. */
+static void fallback_schedule(void)
+{
+	uint16_t acc = g_fallback_frac + (uint16_t)((FALLBACK_TICK >> CLKPR) & 0xff);
+
+	OCR1B += (uint16_t)(FALLBACK_TICK >> CLKPR >> 8) + (acc >> 8);
+	g_fallback_frac = acc;
+}
+
+
+static void fallback_exit(void)
+{
+	TIMSK &= ~(1 << OCIE1B);
+	WDTCSR |= 1 << WDIE;
+	g_fallback = 0;
+#ifdef TELEMETRY
+	g_tel.armed = 0;
+#endif
+
+	if (g_time_set)
+		g_time_set = TIME_APPROX;
+
+#ifdef PPS_CALIB
+	/* Pulse interval spans the fault */
+	g_pps_interval = 0xffff;
+#endif
+}
+
+
+ISR(WDT_OVERFLOW_vect)
+{
+	wdt_reset();
+	EVENT(ev_wdt);
+
+	g_fallback = 1;
+	g_fallback_frac = 0;
+	OCR1B = TCNT1;
+	fallback_schedule();
+	TIFR = 1 << OCF1B;
+	TIMSK |= 1 << OCIE1B;
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
+	/* Ticks missed during the timeout */
+	g_subseconds += WARM_WDT - 1;
+	rtc_tick(0);
+}
+
+
+ISR(TIMER1_COMPB_vect)
+{
+	wdt_reset();
+	EVENT_ISR(ev_t1_compb);
+	rtc_tick(0);
+	fallback_schedule();
+}
+#endif
+
+
+ISR(INT0_vect)
+{
+	byte update = 0;
+#ifdef TELEMETRY
+	uint16_t start = TCNT1;
+#endif
+
+	wdt_reset();
+	EVENT_ISR(ev_int0);
+
+#ifdef HOLDOVER
+	if (g_pf_state == pf_holdover && holdover_wake()) {
+		EVENT_ISR(ev_int0_end);
+		return;
+	}
+#endif
+
+#ifdef XTAL_FALLBACK
+	if (g_fallback)
+		fallback_exit();
+#endif
+
+#ifdef PPS_CALIB
+	update = pps_handle();
+#endif
+
+#ifdef NMEA
+	update |= nmea_pps();
+#endif
+
+	rtc_tick(update);
+
+#ifdef TELEMETRY
+	telemetry_tick(start);
+#endif
+	EVENT_ISR(ev_int0_end);
+}
+
+
+/* Select new digit */
+ISR(TIMER0_OVF_vect)
+{
+	EVENT_ISR(ev_t0_ovf);
+
+	/* Enable on and ramp-up segments, ramp-down stay disabled */
+	PORTB = (g_led_on[g_curr_digit] | g_led_rampup[g_curr_digit]) &
+		~g_led_rampdown[g_curr_digit];
+
+	PORTD &= ~(1 << (3 + g_curr_digit));
+
+#ifdef TELEMETRY
+	++g_tel.t0;
+#endif
+}
+
+
+/* Stop ramp-up, start ramp-down */
+ISR(TIMER0_COMPA_vect)
+{
+	EVENT_ISR(ev_t0_compa);
+
+	/* Disable ramp-up segments, enable ramp-down */
+	if (g_rampcnt < RAMP_MAX)
+		PORTB = (PORTB & ~g_led_rampup[g_curr_digit]) | g_led_rampdown[g_curr_digit];
+
+#ifdef TELEMETRY
+	++g_tel.t0;
+#endif
+}
+
+
+/* Disable screen (brightness control) */
+ISR(TIMER0_COMPB_vect)
+{
+	EVENT_ISR(ev_t0_compb);
+
+	PORTB = 0;
+	PORTD |= 0xf << 3;
+	g_curr_digit = (g_curr_digit + 1) % 4;
+
+	if (!g_curr_digit) {
+#ifdef BRIGHT_FADE
+		bright_step();
+#endif
+#ifdef EASING
+		ease_step();
+#else
+		set_ramp(g_rampcnt + RAMP_INC);
+#endif
+	}
+
+#ifdef TELEMETRY
+	++g_tel.t0;
+#endif
+}
+
+
+int main(void)
+{
+	byte warm = 0;
+
+#if defined(WARM_RESET) || defined(EVENT_TRACE)
+	byte cause = MCUSR;
+
+	MCUSR = 0;
+#endif
+	wdt_enable(WDTO_250MS);
+	wdt_reset();
+#ifdef XTAL_FALLBACK
+	WDTCSR |= 1 << WDIE;
+#endif
+#ifdef TELEMETRY
+	stack_paint();
+#endif
+#ifdef EVENT_TRACE
+	event_start(cause);
+#endif
+
+#ifdef WARM_RESET
+	/* Parameters survive a reset the time doesn't (running
+	 * past its range while the crystal is stopped) */
+	warm = !(cause & (1 << PORF)) && g_time_chk == time_checksum();
+	if (!time_restore(cause))
+#endif
+		g_hours = 12;
 
 	/* Init screen */
 	PORTB = 0;
@@ -472,8 +3188,27 @@ int main(void)
 	DDRD |= 0xf << 3;
 	refresh_screen(0);
 
+#ifdef UART
+	/* 9600 8N1, double speed gives the closest rate at 1 MHz too.
+	 * Pull-up keeps RXD idle when nothing is connected */
+	PORTD |= 1 << 0;
+	UBRRL = UART_UBRR(0);
+	UCSRA = 1 << U2X;
+	UCSRB = (1 << RXCIE) | (1 << RXEN) | (1 << TXEN);
+#else
 	/* Buttons - inputs, pull-up enable */
 	PORTD |= (1 << 1) | (1 << 0);
+#endif
+
+#if defined(PPS_CALIB) || defined(NMEA)
+	/* 1PPS reference input, pull-up enable */
+	PORTA |= 1 << PPS_PIN;
+#endif
+
+#ifdef SYNC
+	/* Sync line released, pull-up enable */
+	sync_line(0);
+#endif
 
 	/* Real time clock interrupt generated by an external IC
 	 * every 1/1024th of a second */
@@ -483,25 +3218,65 @@ int main(void)
 	MCUCR |= (1 << ISC01) | (1 << ISC00);
 	GIMSK |= 1 << INT0;
 
+#ifdef LIGHT_SENSE
+	/* Full brightness until the light is known */
+	g_light = 8;
+#endif
+
+	/* Fetch brighness and calibration from eeprom, sets the
+	 * brightness before the ramp is spanned on it */
+	restore_params(warm);
+
 	/* Timer0 - screen management */
 	/* Update OCRx at MAX */
 	TCCR0A = (1 << WGM01) | (1 << WGM00);
 	set_ramp(RAMP_MIN);
-	set_brightness();
 	TIMSK |= (1 << OCIE0B) | (1 << TOIE0) | (1 << OCIE0A);
 	/* Enable counter (1/64 prescaler) */
-	TCCR0B = (1 << CS01) | (1 << CS00);
+	TCCR0B = T0_PRESCALER;
+
+#if defined(OSC_CALIB) || defined(XTAL_FALLBACK) || defined(TELEMETRY)
+	/* Timer1 counts CPU cycles */
+	TCCR1B = 1 << CS10;
+#endif
+
+#ifdef WARM_RESET
+	count_resets(cause);
+#endif
 
-	/* Fetch brighness and calibration from eeprom */
-	restore_params();
+#ifdef POWERFAIL
+	powerfail_restore();
+	refresh_screen(0);
+#endif
+
+#ifdef SCHEDULE
+	sched_load();
+	sched_update();
+#endif
 
 	/* Whole operation is performed in interrupts.
 	 * Stay asleep if there's no interrupt active */
 	sleep_enable();
 	sei();
 
-	while (1)
+	while (1) {
+#ifdef POWERFAIL
+		powerfail_task();
+#endif
+#ifndef FIXED_SETTINGS
+		params_task();
+#endif
+#ifdef EVENT_TRACE
+		event_task();
+#endif
+#ifdef UART
+		uart_task();
+#endif
+#ifdef TELEMETRY
+		telemetry_task();
+#endif
 		sleep_cpu();
+	}
 
 	return 0;
 }
@@ -0,0 +1,227 @@
+/* LEDclock event trace decoder
+ *
+ * Usage: ledevt [-n events] [file]
+ * Prints the events saved by the last watchdog reset (EVENT_TRACE
+ * build) as a timeline, in ms before the last one. Takes the answer
+ * to the E serial command, an EEPROM read out with ISP (make eeprom,
+ * Intel hex) or the EEPROM dump of the simulator (ledsim -E), from
+ * a file or stdin. -n is EVENT_RING of the build (default 8).
+ *
+ * Every event has the low byte of the tick counter (2048 Hz) and
+ * TCNT0 (125 kHz), the ticks place an event within a tick and TCNT0
+ * finds the exact time in its 2.048 ms period. Longer gaps than 256
+ * ticks (125 ms) are seen modulo that. Reset starts a new part of
+ * the timeline.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define EEPROM_SIZE 128
+#define TICK_US     (1e6 / 2048)
+#define T0_US       8.0
+#define T0_PERIOD   (256 * T0_US)
+#define EVENT_MAX   (EEPROM_SIZE / 3)
+
+struct event {
+	unsigned char tag;
+	unsigned char t0;
+	unsigned char sub;
+	double us;
+};
+
+
+static int hex_byte(const char *s)
+{
+	int v = 0;
+
+	for (int i = 0; i < 2; ++i) {
+		v <<= 4;
+		if (s[i] >= '0' && s[i] <= '9')
+			v |= s[i] - '0';
+		else if (s[i] >= 'A' && s[i] <= 'F')
+			v |= s[i] - 'A' + 10;
+		else if (s[i] >= 'a' && s[i] <= 'f')
+			v |= s[i] - 'a' + 10;
+		else
+			return -1;
+	}
+
+	return v;
+}
+
+
+/* Fills the last len bytes of the EEPROM, returns bytes found */
+static int read_input(FILE *f, unsigned char *buf, int len)
+{
+	unsigned char eeprom[EEPROM_SIZE];
+	char line[256];
+	int n = 0, addr, cnt, v, found = 0;
+
+	memset(eeprom, 0xff, sizeof(eeprom));
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		/* E command answer */
+		if (line[0] == 'E' && line[1] == ' ') {
+			for (n = 0; n < len && (v = hex_byte(line + 2 + 2 * n)) >= 0; ++n)
+				buf[n] = v;
+			return n;
+		}
+
+		/* Intel hex data record */
+		if (line[0] == ':' && (cnt = hex_byte(line + 1)) >= 0 && hex_byte(line + 7) == 0) {
+			addr = hex_byte(line + 3) << 8 | hex_byte(line + 5);
+			for (int i = 0; i < cnt && addr + i < EEPROM_SIZE; ++i) {
+				if ((v = hex_byte(line + 9 + 2 * i)) < 0)
+					break;
+				eeprom[addr + i] = v;
+			}
+			found = 1;
+		}
+
+		/* ledsim -E */
+		if (sscanf(line, "eeprom %x:%n", &addr, &n) == 1 && n > 0) {
+			for (int i = 0; i < 16 && addr + i < EEPROM_SIZE; ++i) {
+				if ((v = hex_byte(line + n + 1 + 3 * i)) < 0)
+					break;
+				eeprom[addr + i] = v;
+			}
+			found = 1;
+		}
+	}
+
+	if (!found)
+		return 0;
+
+	memcpy(buf, eeprom + EEPROM_SIZE - len, len);
+
+	return len;
+}
+
+
+static void event_name(const struct event *e, char *s)
+{
+	static const char *names[] = {
+		[0x10] = "INT0", [0x11] = "INT0 end", [0x20] = "TIMER0_OVF",
+		[0x21] = "TIMER0_COMPA", [0x22] = "TIMER0_COMPB", [0x30] = "USART_RX",
+		[0x31] = "USART_UDRE", [0x40] = "WDT_OVERFLOW", [0x41] = "TIMER1_COMPB",
+		[0x70] = "params stored", [0x71] = "power failure saved"
+	};
+	static const char *causes[] = { "power-on", "external", "brown-out", "watchdog" };
+	int arg = e->tag & 0x0f;
+
+	switch (e->tag >> 4) {
+		case 0x0:
+			strcpy(s, "reset:");
+			for (int i = 0; i < 4; ++i) {
+				if (arg & (1 << i))
+					sprintf(s + strlen(s), " %s", causes[i]);
+			}
+			return;
+
+		case 0x5:
+			sprintf(s, "button %s", arg ? "hours" : "minutes");
+			return;
+
+		case 0x6:
+			sprintf(s, "mode %d", arg);
+			return;
+	}
+
+	if (e->tag < sizeof(names) / sizeof(names[0]) && names[e->tag] != NULL)
+		strcpy(s, names[e->tag]);
+	else
+		sprintf(s, "? %02x", e->tag);
+}
+
+
+/* Time from the previous event: the ticks give it within a tick
+ * either way, TCNT0 gives it modulo its period */
+static double event_delta(const struct event *a, const struct event *b)
+{
+	double coarse = (unsigned char)(b->sub - a->sub) * TICK_US;
+	double fine = (unsigned char)(b->t0 - a->t0) * T0_US;
+
+	return fine + T0_PERIOD * floor((coarse - fine) / T0_PERIOD + 0.5);
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned char buf[3 * EVENT_MAX];
+	struct event ev[EVENT_MAX];
+	int opt, ring = 8, n, first, cnt = 0, usage = 0;
+	char name[64];
+	FILE *f = stdin;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				ring = atoi(optarg);
+				break;
+
+			default:
+				usage = 1;
+				break;
+		}
+	}
+
+	if (usage || optind < argc - 1 || ring < 1 || ring > EVENT_MAX) {
+		fprintf(stderr, "Usage: %s [-n events] [file]\n", argv[0]);
+		return 1;
+	}
+
+	if (optind == argc - 1 && (f = fopen(argv[optind], "r")) == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	n = read_input(f, buf, 3 * ring) / 3;
+	if (f != stdin)
+		fclose(f);
+
+	/* Records never written are erased EEPROM */
+	for (int i = 0; i < n; ++i) {
+		if (buf[3 * i] == 0xff)
+			continue;
+		ev[cnt].tag = buf[3 * i];
+		ev[cnt].t0 = buf[3 * i + 1];
+		ev[cnt].sub = buf[3 * i + 2];
+		++cnt;
+	}
+
+	if (!cnt) {
+		fprintf(stderr, "ledevt: no events\n");
+		return 1;
+	}
+
+	/* Times of every part relative to its last event */
+	for (first = 0; first < cnt; ) {
+		int last = first;
+
+		ev[first].us = 0;
+		while (last + 1 < cnt && ev[last + 1].tag >> 4 != 0) {
+			ev[last + 1].us = ev[last].us + event_delta(&ev[last], &ev[last + 1]);
+			++last;
+		}
+
+		if (first)
+			printf("\n");
+		printf("     ms  tick  t0  event\n");
+		for (int i = first; i <= last; ++i) {
+			event_name(&ev[i], name);
+			printf("%7.3f  %4d %3d  %s\n", (ev[i].us - ev[last].us) / 1000, ev[i].sub, ev[i].t0, name);
+		}
+
+		first = last + 1;
+	}
+
+	return 0;
+}
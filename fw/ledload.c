@@ -0,0 +1,338 @@
+/* LEDclock serial uploader
+ *
+ * Usage: ledload [-p port] [-a] [-b ms] image.hex
+ * Writes the application through the serial loader (boot.c).
+ * The loader is entered by a break held over the clock's reset:
+ * -a asks the running firmware (UART build) to reset with the U
+ * command, otherwise the clock has to be powered up while the
+ * break lasts (5 s, 0.5 s with -a, -b sets it). Reset vector of
+ * the image is moved right below the loader and word 0 jumps to
+ * the loader. Pages go at full speed with CRC, the loader reads
+ * each one back, a failed page is sent again.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define FLASH_SIZE 2048
+#define PAGE_SIZE  32
+#define RETRIES    3
+#define SYNC_TRIES 40   /* Enough to fill up a page the loader waits for */
+#define SYNC_MS    100
+#define REPLY_MS   1000
+
+/* rjmp between word addresses, wraps around the flash */
+#define RJMP(from, to) (0xc000 | (((to) - (from) - 1) & 0x0fff))
+
+
+static int hex_byte(const char *s)
+{
+	int v = 0;
+
+	for (int i = 0; i < 2; ++i) {
+		v <<= 4;
+		if (s[i] >= '0' && s[i] <= '9')
+			v |= s[i] - '0';
+		else if (s[i] >= 'A' && s[i] <= 'F')
+			v |= s[i] - 'A' + 10;
+		else if (s[i] >= 'a' && s[i] <= 'f')
+			v |= s[i] - 'a' + 10;
+		else
+			return -1;
+	}
+
+	return v;
+}
+
+
+/* Intel hex, end is set past the last byte */
+static int hex_read(const char *path, uint8_t *img, unsigned int *end)
+{
+	char line[600];
+	unsigned int n, addr, len, sum;
+	int b[sizeof(line) / 2];
+	FILE *f;
+
+	memset(img, 0xff, FLASH_SIZE);
+	*end = 0;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if ((len = strcspn(line, "\r\n")) == 0)
+			continue;
+
+		if (line[0] != ':' || len < 11 || len % 2 == 0)
+			break;
+
+		for (n = 0, sum = 0; n < (len - 1) / 2; ++n) {
+			if ((b[n] = hex_byte(line + 1 + 2 * n)) < 0)
+				break;
+			sum += b[n];
+		}
+
+		/* Count, address, type, data, checksum */
+		if (n != (len - 1) / 2 || n != b[0] + 5u || (sum & 0xff))
+			break;
+
+		if (b[3] == 1) {
+			fclose(f);
+			return 0;
+		}
+
+		if (b[3] != 0)
+			continue;
+
+		addr = b[1] << 8 | b[2];
+		if (addr + b[0] > FLASH_SIZE) {
+			fprintf(stderr, "%s: data past the flash end\n", path);
+			fclose(f);
+			return -1;
+		}
+
+		for (n = 0; n < b[0]; ++n)
+			img[addr + n] = b[4 + n];
+		if (addr + n > *end)
+			*end = addr + n;
+	}
+
+	fprintf(stderr, "%s: not a valid Intel hex file\n", path);
+	fclose(f);
+
+	return -1;
+}
+
+
+/* Moves the reset vector below the loader (boot is its byte
+ * address), end is set past the moved vector */
+static int image_patch(uint8_t *img, unsigned int *end, unsigned int boot)
+{
+	unsigned int entry = boot - 2, w = img[0] | img[1] << 8;
+	int target;
+
+	if (*end > entry) {
+		fprintf(stderr, "ledload: image takes %u bytes, %u fit below the loader\n", *end, entry);
+		return -1;
+	}
+
+	if ((w & 0xf000) != 0xc000) {
+		fprintf(stderr, "ledload: reset vector is not an rjmp\n");
+		return -1;
+	}
+
+	target = w & 0x0fff;
+	if (target & 0x0800)
+		target -= 0x1000;
+	target = (target + 1) & (FLASH_SIZE / 2 - 1);
+
+	w = RJMP(entry / 2, target);
+	img[entry] = w & 0xff;
+	img[entry + 1] = w >> 8;
+	w = RJMP(0, boot / 2);
+	img[0] = w & 0xff;
+	img[1] = w >> 8;
+	*end = boot;
+
+	return 0;
+}
+
+
+static uint16_t crc_xmodem(uint16_t crc, uint8_t c)
+{
+	crc ^= (uint16_t)c << 8;
+
+	for (int i = 0; i < 8; ++i)
+		crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+
+	return crc;
+}
+
+
+static int port_open(const char *path)
+{
+	struct termios t;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_NOCTTY)) < 0 || tcgetattr(fd, &t) < 0) {
+		perror(path);
+		return -1;
+	}
+
+	cfmakeraw(&t);
+	cfsetispeed(&t, B9600);
+	cfsetospeed(&t, B9600);
+	t.c_cflag |= CLOCAL | CREAD;
+	t.c_cc[VMIN] = 0;
+	t.c_cc[VTIME] = 0;
+
+	if (tcsetattr(fd, TCSANOW, &t) < 0) {
+		perror(path);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/* Returns -1 on timeout */
+static int port_get(int fd, int ms)
+{
+	struct pollfd p = { .fd = fd, .events = POLLIN };
+	uint8_t c;
+
+	if (poll(&p, 1, ms) != 1 || read(fd, &c, 1) != 1)
+		return -1;
+
+	return c;
+}
+
+
+static int port_put(int fd, const uint8_t *buf, unsigned int len)
+{
+	return write(fd, buf, len) == len ? 0 : -1;
+}
+
+
+/* Returns the number of application pages, the loader could wait
+ * in the middle of a page, the sync bytes fill it up then */
+static int loader_sync(int fd)
+{
+	uint8_t cmd = 'S';
+	int c;
+
+	for (int i = 0; i < SYNC_TRIES; ++i) {
+		if (port_put(fd, &cmd, 1) < 0)
+			return -1;
+
+		while ((c = port_get(fd, SYNC_MS)) >= 0) {
+			if (c == 'L')
+				return port_get(fd, SYNC_MS);
+		}
+	}
+
+	return -1;
+}
+
+
+/* Returns 0 once written, -1 if refused, -2 on timeout */
+static int page_send(int fd, const uint8_t *img, unsigned int page)
+{
+	uint8_t buf[2 + PAGE_SIZE + 2];
+	uint16_t crc;
+	int c;
+
+	buf[0] = 'W';
+	buf[1] = page;
+	memcpy(buf + 2, img + page * PAGE_SIZE, PAGE_SIZE);
+
+	crc = 0;
+	for (int i = 1; i < 2 + PAGE_SIZE; ++i)
+		crc = crc_xmodem(crc, buf[i]);
+	buf[2 + PAGE_SIZE] = crc >> 8;
+	buf[3 + PAGE_SIZE] = crc & 0xff;
+
+	if (port_put(fd, buf, sizeof(buf)) < 0 || (c = port_get(fd, REPLY_MS)) < 0)
+		return -2;
+
+	return c == 'K' ? 0 : -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+	static uint8_t img[FLASH_SIZE];
+	const char *port = "/dev/ttyUSB0";
+	unsigned int end, resent = 0, last, page;
+	int opt, fd, pages, res, tries, app = 0, brk = -1;
+	uint8_t cmd;
+
+	while ((opt = getopt(argc, argv, "p:ab:")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = optarg;
+				break;
+
+			case 'a':
+				app = 1;
+				break;
+
+			case 'b':
+				brk = atoi(optarg);
+				break;
+
+			default:
+				optind = argc;
+				break;
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-p port] [-a] [-b ms] image.hex\n", argv[0]);
+		return 1;
+	}
+
+	if (hex_read(argv[optind], img, &end) < 0 || (fd = port_open(port)) < 0)
+		return 1;
+
+	if (brk < 0)
+		brk = app ? 500 : 5000;
+
+	if (app) {
+		port_put(fd, (const uint8_t *)"U\r", 2);
+		tcdrain(fd);
+	}
+	else {
+		fprintf(stderr, "ledload: power the clock up\n");
+	}
+
+	/* Not every port can send a break, the loader can be entered
+	 * with the minutes button held then */
+	ioctl(fd, TIOCSBRK);
+	usleep(brk * 1000L);
+	ioctl(fd, TIOCCBRK);
+	tcflush(fd, TCIFLUSH);
+
+	if ((pages = loader_sync(fd)) <= 0) {
+		fprintf(stderr, "ledload: no answer from the loader\n");
+		return 1;
+	}
+
+	if (image_patch(img, &end, pages * PAGE_SIZE) < 0)
+		return 1;
+
+	/* Every application page, the ones past the image are erased */
+	last = (end - 1) / PAGE_SIZE;
+	for (page = 0; page <= last; ++page) {
+		for (tries = 0; (res = page_send(fd, img, page)) < 0; ++resent) {
+			if (++tries > RETRIES || (res == -2 && loader_sync(fd) < 0)) {
+				fprintf(stderr, "ledload: page %u failed\n", page);
+				return 1;
+			}
+		}
+	}
+
+	cmd = 'Q';
+	if (port_put(fd, &cmd, 1) < 0 || port_get(fd, REPLY_MS) != 'Q') {
+		fprintf(stderr, "ledload: loader didn't quit\n");
+		return 1;
+	}
+
+	printf("ledload: %u pages written, %u resent\n", last + 1, resent);
+	close(fd);
+
+	return 0;
+}
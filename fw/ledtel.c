@@ -0,0 +1,98 @@
+/* LEDclock telemetry decoder
+ *
+ * Usage: ledtel [file]
+ * Decodes telemetry frames (TELEMETRY build) from the clock's
+ * serial output, a file or stdin, e.g.:
+ * stty -F /dev/ttyUSB0 9600 raw && ledtel < /dev/ttyUSB0
+ * and prints them as CSV, one line per frame. Text answers and
+ * damaged frames are skipped, lost ones are counted from the
+ * sequence numbers.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TEL_SYNC  0xa5
+#define TEL_FRAME 11
+
+
+static uint8_t crc8(uint8_t crc, uint8_t c)
+{
+	crc ^= c;
+
+	for (int i = 0; i < 8; ++i)
+		crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+
+	return crc;
+}
+
+
+static int frame_ok(const uint8_t *f)
+{
+	uint8_t crc = 0;
+
+	for (int i = 1; i < TEL_FRAME - 1; ++i)
+		crc = crc8(crc, f[i]);
+
+	return f[0] == TEL_SYNC && crc == f[TEL_FRAME - 1];
+}
+
+
+int main(int argc, char *argv[])
+{
+	uint8_t buf[TEL_FRAME];
+	unsigned int len = 0, lost;
+	int c, seq = -1;
+	FILE *f = stdin;
+
+	if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+		fprintf(stderr, "Usage: %s [file]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc == 2 && (f = fopen(argv[1], "rb")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	printf("seq,lost,int0_cycles,missed_ticks,timer0_irqs,ramp,mode,stack_free\n");
+
+	while ((c = getc(f)) != EOF) {
+		if (!len && c != TEL_SYNC)
+			continue;
+
+		buf[len++] = c;
+		if (len < TEL_FRAME)
+			continue;
+
+		/* Damaged frame, look for the start in what follows */
+		if (!frame_ok(buf)) {
+			uint8_t *p = memchr(buf + 1, TEL_SYNC, TEL_FRAME - 1);
+
+			len = 0;
+			if (p != NULL) {
+				len = buf + TEL_FRAME - p;
+				memmove(buf, p, len);
+			}
+			continue;
+		}
+
+		lost = seq < 0 ? 0 : (uint8_t)(buf[1] - seq - 1);
+		seq = buf[1];
+		len = 0;
+
+		printf("%u,%u,%u,%u,%u,%u,%u,%u\n", buf[1], lost, buf[2] | buf[3] << 8, buf[4],
+			buf[5] | buf[6] << 8, buf[7], buf[8], buf[9]);
+		fflush(stdout);
+	}
+
+	if (f != stdin)
+		fclose(f);
+
+	return 0;
+}
@@ -0,0 +1,28 @@
+/* LEDclock host simulator
+ * Minimal <avr/boot.h> replacement
+ *
+ * Self-programming goes to the flash model of the loader test
+ * (bootsim.c), writes finish at once.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#ifndef SIM_AVR_BOOT_H
+#define SIM_AVR_BOOT_H
+
+#include <avr/io.h>
+
+void sim_page_fill(uint16_t addr, uint16_t word);
+void sim_page_clear(void);
+void sim_page_erase(uint16_t addr);
+void sim_page_write(uint16_t addr);
+
+#define boot_page_fill(addr, word) sim_page_fill(addr, word)
+#define boot_page_clear()          sim_page_clear()
+#define boot_page_erase(addr)      sim_page_erase(addr)
+#define boot_page_write(addr)      sim_page_write(addr)
+#define boot_spm_busy_wait()       ((void)0)
+
+#endif
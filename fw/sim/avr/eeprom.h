@@ -0,0 +1,70 @@
+/* LEDclock host simulator
+ * Minimal <avr/eeprom.h> replacement (128 bytes)
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+
+#include <stdint.h>
+
+#define E2END 127
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+void eeprom_write_byte(uint8_t *addr, uint8_t val);
+
+/* Returns int16_t instead of uint16_t, so assigning
+ * the result to a (32-bit on the host) int behaves
+ * the same way as it does on the 16-bit int target */
+static inline int16_t eeprom_read_word(const uint16_t *addr)
+{
+	return eeprom_read_byte((const uint8_t *)addr) |
+		(eeprom_read_byte((const uint8_t *)addr + 1) << 8);
+}
+
+
+static inline void eeprom_write_word(uint16_t *addr, uint16_t val)
+{
+	eeprom_write_byte((uint8_t *)addr, val & 0xff);
+	eeprom_write_byte((uint8_t *)addr + 1, val >> 8);
+}
+
+
+static inline uint32_t eeprom_read_dword(const uint32_t *addr)
+{
+	return (uint16_t)eeprom_read_word((const uint16_t *)addr) |
+		((uint32_t)(uint16_t)eeprom_read_word((const uint16_t *)addr + 1) << 16);
+}
+
+
+static inline void eeprom_write_dword(uint32_t *addr, uint32_t val)
+{
+	eeprom_write_word((uint16_t *)addr, val & 0xffff);
+	eeprom_write_word((uint16_t *)addr + 1, val >> 16);
+}
+
+
+static inline void eeprom_update_byte(uint8_t *addr, uint8_t val)
+{
+	if (eeprom_read_byte(addr) != val)
+		eeprom_write_byte(addr, val);
+}
+
+
+static inline void eeprom_update_word(uint16_t *addr, uint16_t val)
+{
+	eeprom_update_byte((uint8_t *)addr, val & 0xff);
+	eeprom_update_byte((uint8_t *)addr + 1, val >> 8);
+}
+
+
+static inline void eeprom_update_dword(uint32_t *addr, uint32_t val)
+{
+	eeprom_update_word((uint16_t *)addr, val & 0xffff);
+	eeprom_update_word((uint16_t *)addr + 1, val >> 16);
+}
+
+#endif
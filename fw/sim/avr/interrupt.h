@@ -0,0 +1,31 @@
+/* LEDclock host simulator
+ * Minimal <avr/interrupt.h> replacement
+ *
+ * Interrupt handlers become ordinary functions named after
+ * their vectors, so the simulator can call them directly.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#define ISR(vector) void vector(void)
+
+ISR(INT0_vect);
+ISR(TIMER0_OVF_vect);
+ISR(TIMER0_COMPA_vect);
+ISR(TIMER0_COMPB_vect);
+ISR(TIMER1_COMPB_vect);
+ISR(WDT_OVERFLOW_vect);
+ISR(USART_RX_vect);
+ISR(USART_UDRE_vect);
+
+extern volatile unsigned char sim_sreg_i;
+
+#define sei() (sim_sreg_i = 1)
+#define cli() (sim_sreg_i = 0)
+
+#endif
@@ -0,0 +1,129 @@
+/* LEDclock host simulator
+ * Minimal <avr/io.h> replacement for ATtiny2313
+ *
+ * I/O registers are plain variables owned by the simulator.
+ * The simulator samples them after every interrupt handler
+ * and feeds inputs (PINx, TCNTx) before calling one.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+extern volatile uint8_t PORTA, DDRA, PINA;
+extern volatile uint8_t PORTB, DDRB, PINB;
+extern volatile uint8_t PORTD, DDRD, PIND;
+extern volatile uint8_t MCUCR, MCUSR, GIMSK, EIFR, CLKPR, OSCCAL, GPIOR0, WDTCSR;
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK, TIFR;
+extern volatile uint8_t TCCR1A, TCCR1B;
+extern volatile uint16_t TCNT1, OCR1A, OCR1B, ICR1;
+extern volatile uint8_t ACSR;
+extern volatile uint8_t UCSRA, UCSRB, UCSRC, UBRRL, UBRRH;
+/* Bit 8 set - nothing written since the simulator looked */
+extern volatile uint16_t UDR;
+extern volatile uint8_t SPMCSR;
+
+#define SPM_PAGESIZE 32
+
+/* MCUCR */
+#define ISC00  0
+#define ISC01  1
+#define ISC10  2
+#define ISC11  3
+#define SM0    4
+#define SE     5
+#define SM1    6
+#define PUD    7
+
+/* MCUSR */
+#define PORF   0
+#define EXTRF  1
+#define BORF   2
+#define WDRF   3
+
+/* WDTCSR */
+#define WDE    3
+#define WDCE   4
+#define WDIE   6
+#define WDIF   7
+
+/* EIFR */
+#define PCIF   5
+#define INTF0  6
+#define INTF1  7
+
+/* GIMSK */
+#define PCIE   5
+#define INT0   6
+#define INT1   7
+
+/* TCCR0A */
+#define WGM00  0
+#define WGM01  1
+
+/* TCCR0B */
+#define CS00   0
+#define CS01   1
+#define CS02   2
+#define WGM02  3
+
+/* TIMSK */
+#define OCIE0A 0
+#define TOIE0  1
+#define OCIE0B 2
+#define ICIE1  3
+#define OCIE1B 5
+#define OCIE1A 6
+#define TOIE1  7
+
+/* TIFR */
+#define OCF0A  0
+#define TOV0   1
+#define OCF0B  2
+#define ICF1   3
+#define OCF1B  5
+#define OCF1A  6
+#define TOV1   7
+
+/* UCSRA */
+#define MPCM   0
+#define U2X    1
+#define UPE    2
+#define DOR    3
+#define FE     4
+#define UDRE   5
+#define TXC    6
+#define RXC    7
+
+/* UCSRB */
+#define TXB8   0
+#define RXB8   1
+#define UCSZ2  2
+#define TXEN   3
+#define RXEN   4
+#define UDRIE  5
+#define TXCIE  6
+#define RXCIE  7
+
+/* TCCR1B */
+#define CS10   0
+#define CS11   1
+#define CS12   2
+
+/* SPMCSR */
+#define SELFPRGEN 0
+#define PGERS  1
+#define PGWRT  2
+#define RFLB   3
+#define CTPB   4
+
+/* CLKPR */
+#define CLKPS0 0
+#define CLKPCE 7
+
+#endif
@@ -0,0 +1,21 @@
+/* LEDclock host simulator
+ * Minimal <avr/pgmspace.h> replacement
+ *
+ * Program memory is ordinary host memory.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#ifndef SIM_AVR_PGMSPACE_H
+#define SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+
+#endif
@@ -0,0 +1,29 @@
+/* LEDclock host simulator
+ * Minimal <avr/sleep.h> replacement
+ *
+ * sleep_cpu() hands control to the simulator, which runs
+ * interrupt handlers until the CPU would wake up again.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#ifndef SIM_AVR_SLEEP_H
+#define SIM_AVR_SLEEP_H
+
+#include <avr/io.h>
+
+void sim_sleep(void);
+
+#define SLEEP_MODE_IDLE     0
+#define SLEEP_MODE_PWR_DOWN (1 << SM0)
+#define SLEEP_MODE_STANDBY  (1 << SM1)
+
+#define set_sleep_mode(mode) \
+	(MCUCR = (MCUCR & ~((1 << SM0) | (1 << SM1))) | (mode))
+#define sleep_enable()  (MCUCR |= 1 << SE)
+#define sleep_disable() (MCUCR &= ~(1 << SE))
+#define sleep_cpu()     sim_sleep()
+
+#endif
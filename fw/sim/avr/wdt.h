@@ -0,0 +1,27 @@
+/* LEDclock host simulator
+ * Minimal <avr/wdt.h> replacement
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#ifndef SIM_AVR_WDT_H
+#define SIM_AVR_WDT_H
+
+#define WDTO_15MS  0
+#define WDTO_30MS  1
+#define WDTO_60MS  2
+#define WDTO_120MS 3
+#define WDTO_250MS 4
+#define WDTO_500MS 5
+#define WDTO_1S    6
+#define WDTO_2S    7
+
+void sim_wdt_enable(unsigned char timeout);
+void sim_wdt_reset(void);
+
+#define wdt_enable(t) sim_wdt_enable(t)
+#define wdt_reset()   sim_wdt_reset()
+
+#endif
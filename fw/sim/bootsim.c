@@ -0,0 +1,304 @@
+/* LEDclock host simulator
+ * Serial loader test
+ *
+ * Usage: bootsim [-e n] image.hex
+ * Runs the loader (boot.c compiled for the host) against the
+ * uploader (ledload.c) over a pseudo terminal and compares the
+ * flash with the image afterwards. -e n corrupts a data byte of
+ * every nth page sent. Reports what was written and how long the
+ * upload takes at 9600 baud.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#define _GNU_SOURCE
+
+#define main ledload_main
+#include "../ledload.c"
+#undef main
+
+#include <setjmp.h>
+#include <sys/wait.h>
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+/* Loader's USART accesses move bytes to and from the pty */
+#define UCSRA (*boot_ucsra())
+#define UDR   (*boot_udr())
+static volatile uint8_t *boot_ucsra(void);
+static volatile uint8_t *boot_udr(void);
+
+#undef pgm_read_byte
+#define pgm_read_byte(addr) boot_flash(addr)
+static uint8_t boot_flash(uint16_t addr);
+
+#define main boot_main
+#include "../boot.c"
+#undef main
+
+#define BAUD      9600
+#define T_PAGE    9e-3   /* Page erase and write */
+#define T_TIMEOUT 8.4    /* Timer1 overflow */
+#define POLL_MS   10
+
+volatile uint8_t PORTD, PIND, UBRRL, UCSRB, TCCR1B, TIFR, SPMCSR;
+volatile uint16_t TCNT1;
+
+static struct {
+	int fd;
+	pid_t pid;
+	int status;
+	int err;
+	jmp_buf exit;
+
+	uint8_t flash[FLASH_SIZE];
+	uint16_t buf[SPM_PAGESIZE / 2];
+	uint16_t filled;
+
+	uint8_t ucsra;
+	uint8_t udr;
+	uint8_t rx;
+	uint8_t last_tx;
+	int tx_pending;
+	int frame;
+	double idle;
+
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+	unsigned long frames;
+	unsigned long corrupted;
+	unsigned long writes;
+	unsigned long faults;
+} boot;
+
+
+/* Break ends once the loader waits for it */
+void sim_wdt_reset(void)
+{
+	PIND |= 1 << 0;
+}
+
+
+void sim_page_fill(uint16_t addr, uint16_t word)
+{
+	unsigned int i = addr % SPM_PAGESIZE / 2;
+
+	/* Buffer takes each word once */
+	if (boot.filled & (1 << i))
+		++boot.faults;
+
+	boot.buf[i] = word;
+	boot.filled |= 1 << i;
+}
+
+
+void sim_page_clear(void)
+{
+	boot.filled = 0;
+}
+
+
+void sim_page_erase(uint16_t addr)
+{
+	addr -= addr % SPM_PAGESIZE;
+	if (addr >= BOOT_START)
+		++boot.faults;
+	else
+		memset(boot.flash + addr, 0xff, SPM_PAGESIZE);
+}
+
+
+void sim_page_write(uint16_t addr)
+{
+	addr -= addr % SPM_PAGESIZE;
+	if (addr >= BOOT_START) {
+		++boot.faults;
+	}
+	else {
+		/* Programming clears bits only */
+		for (int i = 0; i < SPM_PAGESIZE / 2; ++i) {
+			if (boot.filled & (1 << i)) {
+				boot.flash[addr + 2 * i] &= boot.buf[i] & 0xff;
+				boot.flash[addr + 2 * i + 1] &= boot.buf[i] >> 8;
+			}
+		}
+	}
+
+	++boot.writes;
+	boot.filled = 0;
+}
+
+
+static uint8_t boot_flash(uint16_t addr)
+{
+	return boot.flash[addr % FLASH_SIZE];
+}
+
+
+static void boot_flush(void)
+{
+	if (!boot.tx_pending)
+		return;
+
+	if (write(boot.fd, &boot.udr, 1) == 1)
+		++boot.bytes_out;
+	boot.last_tx = boot.udr;
+	boot.tx_pending = 0;
+}
+
+
+/* Loader resets the MCU to leave */
+void sim_wdt_enable(unsigned char timeout)
+{
+	boot_flush();
+	longjmp(boot.exit, 1);
+}
+
+
+/* Follows the frames to corrupt a data byte in every nth page */
+static uint8_t boot_corrupt(uint8_t c)
+{
+	if (boot.frame) {
+		if (--boot.frame == SPM_PAGESIZE && boot.err && boot.frames % boot.err == 0) {
+			c ^= 0x10;
+			++boot.corrupted;
+		}
+	}
+	else if (c == 'W') {
+		boot.frame = 1 + SPM_PAGESIZE + 2;
+		++boot.frames;
+	}
+
+	return c;
+}
+
+
+static volatile uint8_t *boot_ucsra(void)
+{
+	struct pollfd p = { .fd = boot.fd, .events = POLLIN };
+	uint8_t c;
+
+	boot_flush();
+	boot.ucsra |= 1 << UDRE;
+
+	if (boot.ucsra & (1 << RXC))
+		return &boot.ucsra;
+
+	if (poll(&p, 1, POLL_MS) == 1 && read(boot.fd, &c, 1) == 1) {
+		boot.rx = boot_corrupt(c);
+		boot.ucsra |= 1 << RXC;
+		boot.idle = 0;
+		++boot.bytes_in;
+		return &boot.ucsra;
+	}
+
+	/* Uploader gone, no need to wait for the timeout */
+	boot.idle += POLL_MS / 1000.0;
+	if (boot.pid && waitpid(boot.pid, &boot.status, WNOHANG) == boot.pid) {
+		boot.pid = 0;
+		TIFR |= 1 << TOV1;
+	}
+	if (boot.idle > T_TIMEOUT)
+		TIFR |= 1 << TOV1;
+
+	return &boot.ucsra;
+}
+
+
+static volatile uint8_t *boot_udr(void)
+{
+	boot_flush();
+
+	if (boot.ucsra & (1 << RXC)) {
+		boot.ucsra &= ~(1 << RXC);
+		boot.udr = boot.rx;
+	}
+	else {
+		boot.tx_pending = 1;
+	}
+
+	return &boot.udr;
+}
+
+
+static int pty_open(char *name, size_t len)
+{
+	struct termios t;
+	int fd;
+
+	if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0 ||
+			ptsname_r(fd, name, len) != 0 || tcgetattr(fd, &t) < 0) {
+		perror("pty");
+		return -1;
+	}
+
+	/* No echo until the uploader sets the port up */
+	cfmakeraw(&t);
+	tcsetattr(fd, TCSANOW, &t);
+
+	return fd;
+}
+
+
+int main(int argc, char *argv[])
+{
+	static uint8_t img[FLASH_SIZE];
+	char name[64];
+	unsigned int end, differ = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:")) != -1) {
+		switch (opt) {
+			case 'e':
+				boot.err = atoi(optarg);
+				break;
+
+			default:
+				optind = argc;
+				break;
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-e n] image.hex\n", argv[0]);
+		return 1;
+	}
+
+	if (hex_read(argv[optind], img, &end) < 0 || image_patch(img, &end, BOOT_START) < 0 ||
+			(boot.fd = pty_open(name, sizeof(name))) < 0)
+		return 1;
+
+	/* Old firmware, shows through where nothing was written */
+	for (int i = 0; i < FLASH_SIZE; ++i)
+		boot.flash[i] = i * 7 + 3;
+
+	if ((boot.pid = fork()) == 0) {
+		char *args[] = { "ledload", "-p", name, "-b", "10", argv[optind], NULL };
+
+		close(boot.fd);
+		optind = 1;
+		exit(ledload_main(6, args));
+	}
+
+	/* Uploader holds the break over the reset */
+	PIND = 0;
+	if (!setjmp(boot.exit))
+		boot_main();
+
+	if (boot.pid)
+		waitpid(boot.pid, &boot.status, 0);
+
+	for (unsigned int i = 0; i < end; ++i)
+		differ += boot.flash[i] != img[i];
+
+	printf("pages: %lu sent, %lu corrupted, %lu written\n", boot.frames, boot.corrupted, boot.writes);
+	printf("flash: %u bytes, %u differ, %lu faults\n", end, differ, boot.faults);
+	printf("loader: %s, %.1f s at %d baud\n", boot.last_tx == 'Q' ? "quit" : "timed out",
+		(boot.bytes_in + boot.bytes_out) * 10.0 / BAUD + boot.writes * T_PAGE, BAUD);
+
+	return !WIFEXITED(boot.status) || WEXITSTATUS(boot.status) || differ || boot.faults ||
+		boot.last_tx != 'Q';
+}
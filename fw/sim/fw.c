@@ -0,0 +1,244 @@
+/* LEDclock host simulator
+ * Firmware compiled for the host
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#define main fw_main
+#include "../ledclock.c"
+#undef main
+
+#include "sim.h"
+
+
+void fw_get_time(struct fw_time *t)
+{
+	t->hours = g_hours;
+	t->minutes = g_minutes;
+	t->seconds = g_seconds;
+	t->subseconds = g_subseconds;
+	t->set = g_time_set;
+}
+
+
+void fw_set_time(const struct fw_time *t)
+{
+	g_hours = t->hours;
+	g_minutes = t->minutes;
+	g_seconds = t->seconds;
+	g_subseconds = t->subseconds;
+	g_time_set = t->set;
+#ifdef WARM_RESET
+	time_seal();
+#endif
+	refresh_screen(0);
+}
+
+
+int fw_get_calib(void)
+{
+	return g_params.rtc_calib;
+}
+
+
+void fw_set_calib(int calib)
+{
+	g_params.rtc_calib = calib;
+#ifdef WARM_RESET
+	time_seal();
+#endif
+}
+
+
+/* Role on the sync line, no-op without SYNC */
+void fw_set_sync(int master)
+{
+#ifdef SYNC
+	g_params.sync_master = master;
+#ifdef WARM_RESET
+	time_seal();
+#endif
+#else
+	(void)master;
+#endif
+}
+
+
+static long skipped(long n)
+{
+#ifdef PPS_CALIB
+	g_pps_interval = g_pps_interval + n > 0xffff ? 0xffff : g_pps_interval + n;
+#endif
+#ifdef NMEA
+	g_nmea_age = g_nmea_age + n > RTC_HZ ? RTC_HZ : g_nmea_age + n;
+#endif
+
+	return n;
+}
+
+
+int fw_display_static(void)
+{
+#ifdef BRIGHT_FADE
+	if (g_bright_frames)
+		return 0;
+#endif
+	return g_rampcnt >= RAMP_MAX;
+}
+
+
+#ifdef LOOKAHEAD
+/* Second with a tick putting the next one up early */
+static int fw_ahead(void)
+{
+#ifdef DOTS_FADE
+	return g_time_set && g_mode == mode_normal;
+#else
+	return g_time_set && g_mode == mode_normal && g_seconds == 59;
+#endif
+}
+#endif
+
+
+/* Consumes up to max upcoming INT0 ticks without calling the handler,
+ * returns number of ticks consumed (0 - next tick has to be executed).
+ * Only ticks that increment counters are skipped: ticks within
+ * a second and, when the clock runs undisturbed, whole seconds that
+ * neither roll the minute over nor apply RTC calibration. This has to
+ * follow what ISR(INT0_vect) does. */
+long fw_fast_forward(long max)
+{
+	long n, sec;
+
+	if (g_button_state[0] != button_not_active || g_button_presscnt[0] ||
+			g_button_state[1] != button_not_active || g_button_presscnt[1])
+		return 0;
+
+#ifdef POWERFAIL
+	if (g_pf_state != pf_none || g_pf_cnt)
+		return 0;
+#endif
+
+#ifdef OSC_CALIB
+	if (g_osc_cnt <= OSC_TICKS)
+		return 0;
+#endif
+
+#ifdef XTAL_FALLBACK
+	if (g_fallback)
+		return 0;
+#endif
+
+#ifdef UART
+	if (g_uart_quiet < UART_QUIET)
+		return 0;
+#endif
+
+#ifdef TELEMETRY
+	/* Counters follow every tick, frames go every second */
+	return 0;
+#endif
+
+#ifdef SYNC
+	/* Frame on the line */
+	if (g_params.sync_master ? g_sync.tx != 0 : g_sync.idle < SYNC_IDLE)
+		return 0;
+#endif
+
+#ifdef LIGHT_SENSE
+	/* Discharge is timed every tick, charge and its end have theirs */
+	if (g_light_cnt)
+		return 0;
+	n = g_subseconds & (LIGHT_PERIOD - 1);
+	n = (n < LIGHT_CHARGE ? LIGHT_CHARGE : LIGHT_PERIOD) - 1 - n;
+	if (max > n)
+		max = n;
+	if (!max)
+		return 0;
+#endif
+
+#ifdef CLOCK_SCALING
+	/* Handler slows the clock down as soon as the ramp is done */
+	if (!clock_idle() || !g_clock_slow)
+		return 0;
+#endif
+
+	/* Ticks before the one that completes current second */
+	n = RTC_HZ - 1 - g_subseconds;
+	if (n < 0)
+		return 0;
+
+#ifdef LOOKAHEAD
+	/* Tick putting the next second up early has to run */
+	if (fw_ahead()) {
+		sec = RTC_HZ - 1 - (long)ramp_lead() - g_subseconds;
+		if (sec > 0 && sec < n)
+			n = sec;
+		if (n > max)
+			n = max;
+		g_subseconds += n;
+		return skipped(n);
+	}
+#endif
+
+	if (n >= max) {
+		g_subseconds += max;
+		return skipped(max);
+	}
+
+	if (g_time_set != 1 || g_mode != mode_normal) {
+		g_subseconds += n;
+		return skipped(n);
+	}
+
+#ifdef SCHEDULE
+	/* Blank display's wake-up counts seconds down */
+	if (g_sched_wake) {
+		g_subseconds += n;
+		return skipped(n);
+	}
+#endif
+
+#ifdef LEARN_CALIB
+	if (g_learn_active) {
+		g_subseconds += n;
+		return skipped(n);
+	}
+#endif
+
+	sec = (max - n) / RTC_HZ;
+	if (sec > 59 - g_seconds)
+		sec = 59 - g_seconds;
+#ifdef LOOKAHEAD
+	/* Last one puts the minute up early */
+	if (sec > 58 - g_seconds)
+		sec = 58 - g_seconds;
+#endif
+	if (sec > RTC_HZ - 1 - (long)g_seconds_calib_cnt)
+		sec = RTC_HZ - 1 - g_seconds_calib_cnt;
+
+	g_subseconds = RTC_HZ - 1;
+
+	if (sec > 0) {
+		g_seconds += sec;
+		g_seconds_calib_cnt += sec;
+#ifdef LEARN_CALIB
+		g_params.learn_secs += sec;
+#endif
+#ifdef NMEA
+		g_nmea_wait = g_nmea_wait > sec ? g_nmea_wait - sec : 0;
+#endif
+#ifdef SYNC
+		g_sync.age = g_sync.age + sec > 0xff ? 0xff : g_sync.age + sec;
+#endif
+		/* Fade of the last second would be over by now */
+		dots_snap(dots_state(g_seconds));
+#ifdef WARM_RESET
+		time_seal();
+#endif
+	}
+
+	return skipped(n + sec * RTC_HZ);
+}
@@ -0,0 +1,269 @@
+/* LEDclock host simulator
+ * Port trace reader
+ *
+ * Usage: ledtrace [-s start] [-e end] [-v | -g] file
+ * Prints port changes between start and end (in seconds of
+ * simulated time) as text, or as VCD with -v.
+ *
+ * -g estimates ghosting instead: a digit PNP (BC807) keeps conducting
+ * for PNP_OFF after its line goes high and a ULN2003 output keeps
+ * sinking for ULN_OFF, segments of the next digit lit in that time
+ * glow faintly on the previous one and the other way round. Prints
+ * the dead times between digits and the charge through such pairs,
+ * against the charge of the lit segments.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define PNP_OFF   (2e-6 * TRACE_HZ) /* Digit driver turn-off, storage time */
+#define ULN_OFF   (1e-6 * TRACE_HZ) /* Segment driver turn-off */
+#define I_SEGMENT 20e-3
+#define DIGITS    4
+#define SEGMENTS  7
+
+
+static const char *names[TRACE_CHANNELS] = { "PORTA", "PORTB", "PORTD" };
+
+
+struct ghost {
+	uint64_t digit_on[DIGITS];
+	uint64_t digit_off[DIGITS];
+	uint64_t seg_off[SEGMENTS];
+	uint64_t last_off;
+	uint64_t start;
+	uint64_t time;
+	uint8_t portb;
+	uint8_t portd;
+
+	unsigned long switches;
+	unsigned long short_dead;
+	double dead_min;
+	double dead_sum;
+	double lit;
+	double ghost;
+};
+
+
+static int digit_lit(uint8_t portd, int d)
+{
+	return !(portd & (1 << (3 + d)));
+}
+
+
+/* Part of [from, to) before the driver turned off at off is done */
+static double overlap(uint64_t from, uint64_t to, uint64_t off, double turnoff)
+{
+	double end = off + turnoff;
+
+	if (end <= from)
+		return 0;
+
+	return (end < to ? end : to) - from;
+}
+
+
+/* Segment-digit pairs conducting until the next change */
+static void ghost_span(struct ghost *g, uint64_t to)
+{
+	uint8_t segs = g->portb & 0x7f;
+	uint64_t from = g->time;
+
+	for (int d = 0; d < DIGITS; ++d) {
+		if (digit_lit(g->portd, d)) {
+			g->lit += (double)__builtin_popcount(segs) * (to - from);
+
+			/* Segments turned off before the digit came on */
+			for (int s = 0; s < SEGMENTS; ++s) {
+				if (!(segs & (1 << s)) && g->seg_off[s] <= g->digit_on[d])
+					g->ghost += overlap(from, to, g->seg_off[s], ULN_OFF);
+			}
+		}
+		else if (g->digit_off[d] != 0) {
+			g->ghost += __builtin_popcount(segs) * overlap(from, to, g->digit_off[d], PNP_OFF);
+		}
+	}
+}
+
+
+static void ghost_change(struct ghost *g, const struct trace_reader *r)
+{
+	uint8_t segs = r->val[1] & 0x7f;
+	double dead;
+
+	ghost_span(g, r->time);
+
+	for (int s = 0; s < SEGMENTS; ++s) {
+		if ((g->portb & (1 << s)) && !(segs & (1 << s)))
+			g->seg_off[s] = r->time;
+	}
+
+	for (int d = 0; d < DIGITS; ++d) {
+		int was = digit_lit(g->portd, d), lit = digit_lit(r->val[2], d);
+
+		if (was && !lit)
+			g->digit_off[d] = g->last_off = r->time;
+
+		if (!was && lit) {
+			g->digit_on[d] = r->time;
+			if (g->last_off != 0) {
+				dead = (double)(r->time - g->last_off) / TRACE_HZ;
+				if (!g->switches || dead < g->dead_min)
+					g->dead_min = dead;
+				g->dead_sum += dead;
+				g->short_dead += dead * TRACE_HZ < PNP_OFF;
+				++g->switches;
+			}
+		}
+	}
+
+	g->time = r->time;
+	g->portb = r->val[1];
+	g->portd = r->val[2];
+}
+
+
+static void ghost_report(const struct ghost *g)
+{
+	double t = (double)(g->time - g->start) / TRACE_HZ;
+
+	printf("digit switches %lu", g->switches);
+	if (g->switches) {
+		printf(", dead time min %.1f us, mean %.1f us, %lu under %.1f us",
+			g->dead_min * 1e6, g->dead_sum / g->switches * 1e6, g->short_dead, PNP_OFF * 1e6 / TRACE_HZ);
+	}
+	printf("\n");
+
+	if (t > 0) {
+		printf("lit %.3f mA, ghosting %.3f uA", g->lit * I_SEGMENT / TRACE_HZ / t * 1e3,
+			g->ghost * I_SEGMENT / TRACE_HZ / t * 1e6);
+		if (g->lit > 0)
+			printf(" (%.1f ppm of lit)", g->ghost / g->lit * 1e6);
+		printf("\n");
+	}
+}
+
+
+static void vcd_values(const struct trace_reader *r, const uint8_t *prev)
+{
+	for (int i = 0; i < TRACE_CHANNELS; ++i) {
+		if (prev != NULL && prev[i] == r->val[i])
+			continue;
+
+		putchar('b');
+		for (int b = 7; b >= 0; --b)
+			putchar(r->val[i] & (1 << b) ? '1' : '0');
+		printf(" %c\n", '!' + i);
+	}
+}
+
+
+static void vcd_header(const struct trace_reader *r)
+{
+	printf("$timescale %d ns $end\n", 1000000000 / TRACE_HZ);
+	printf("$scope module ledclock $end\n");
+	for (int i = 0; i < TRACE_CHANNELS; ++i)
+		printf("$var wire 8 %c %s $end\n", '!' + i, names[i]);
+	printf("$upscope $end\n$enddefinitions $end\n");
+	printf("#%llu\n$dumpvars\n", (unsigned long long)r->time);
+	vcd_values(r, NULL);
+	printf("$end\n");
+}
+
+
+static void text_values(const struct trace_reader *r)
+{
+	printf("%.7f", (double)r->time / TRACE_HZ);
+	for (int i = 0; i < TRACE_CHANNELS; ++i)
+		printf(" %s=%02x", names[i], r->val[i]);
+	putchar('\n');
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct trace_reader r;
+	uint64_t start = 0, end = UINT64_MAX;
+	uint8_t prev[TRACE_CHANNELS];
+	struct ghost g = { 0 };
+	int opt, vcd = 0, ghosting = 0;
+
+	while ((opt = getopt(argc, argv, "s:e:vg")) != -1) {
+		switch (opt) {
+			case 's':
+				start = atof(optarg) * TRACE_HZ;
+				break;
+
+			case 'e':
+				end = atof(optarg) * TRACE_HZ;
+				break;
+
+			case 'v':
+				vcd = 1;
+				break;
+
+			case 'g':
+				ghosting = 1;
+				break;
+
+			default:
+				optind = argc;
+				break;
+		}
+	}
+
+	if (optind != argc - 1 || (vcd && ghosting)) {
+		fprintf(stderr, "Usage: %s [-s start] [-e end] [-v | -g] file\n", argv[0]);
+		return 1;
+	}
+
+	if (trace_open(&r, argv[optind]) < 0 || trace_seek(&r, start) < 0) {
+		fprintf(stderr, "%s: not a valid trace\n", argv[optind]);
+		return 1;
+	}
+
+	if (ghosting) {
+		g.start = g.time = r.time < start ? start : r.time;
+		g.portb = r.val[1];
+		g.portd = r.val[2];
+	}
+	else if (vcd) {
+		vcd_header(&r);
+	}
+	else {
+		text_values(&r);
+	}
+
+	for (int i = 0; i < TRACE_CHANNELS; ++i)
+		prev[i] = r.val[i];
+
+	while (trace_next(&r) == 0 && r.time <= end) {
+		if (ghosting) {
+			ghost_change(&g, &r);
+		}
+		else if (vcd) {
+			printf("#%llu\n", (unsigned long long)r.time);
+			vcd_values(&r, prev);
+		}
+		else {
+			text_values(&r);
+		}
+
+		for (int i = 0; i < TRACE_CHANNELS; ++i)
+			prev[i] = r.val[i];
+	}
+
+	trace_release(&r);
+
+	if (ghosting)
+		ghost_report(&g);
+
+	return 0;
+}
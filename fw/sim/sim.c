@@ -0,0 +1,2238 @@
+/* LEDclock host simulator
+ *
+ * Usage: ledsim [options]
+ * -s seconds   simulated time (default 60),
+ * -d days      simulated time in days,
+ * -T hh:mm:ss  time of day at the start (default 12:00:00),
+ * -u           leave the clock unset (blinking) at the start,
+ * -p ppm       crystal frequency error at 25 C,
+ * -k ppm/C2    crystal parabolic temperature coefficient (default -0.034),
+ * -m C         mean ambient temperature (default 25),
+ * -a C         daily temperature swing amplitude, warmest at 15:00,
+ * -g ppm       crystal aging after the first year (logarithmic),
+ * -c calib     set g_rtc_calib at the start,
+ * -B c,c,...   benchmark: for every calibration value run a year
+ *              (fast-forwarded) and report time error after a day,
+ *              a week and a year,
+ * -P           1PPS reference on PA0 (100 ms pulse every true second),
+ * -b t:n:len   press button n (0 - minutes, 1 - hours) at t for len seconds,
+ * -r t:c[:len] reset at t held for len seconds, c is the cause: p - power-on
+ *              (SRAM is lost), e - external, b - brown-out, w - watchdog
+ *              (firmware hangs at t, reset follows the watchdog timeout),
+ * -F t:len[:h] supply failure at t for len seconds, sensed on PA1, MCU runs
+ *              from the bulk capacitor for h seconds (default 0.1), EEPROM
+ *              writes not finished by then are lost,
+ * -o err[:tc]  internal RC oscillator error in % at 25 C with the factory
+ *              OSCCAL and its temperature coefficient in %/C,
+ * -X t:len     crystal (or the 4060) stops at t for len seconds,
+ * -L t:lux     ambient light on the LDR (PA0) is lux at t, changes
+ *              exponentially between the points (LIGHT_SENSE),
+ * -U t:text    send a line to the UART at t (9600 8N1, CR appended),
+ *              lines sent by the firmware are printed as they come,
+ * -N file      feed a recorded NMEA log to the UART, sentences of every
+ *              second start 0.1 s after the PPS edge (use with -P),
+ *              the time of day at the start is taken from the log,
+ * -S f,f,...   sync line (PA1): this clock is the master, a follower
+ *              is run along for every f = ppm[:offset], its crystal
+ *              error and time offset (s) at the start, clocks run in
+ *              parallel and their errors are reported at 10 checkpoints,
+ * -W file      write bytes sent by the UART to file, telemetry frames
+ *              (TELEMETRY) are left out of the printed lines, decode
+ *              them with ledtel,
+ * -E           dump EEPROM contents at the end,
+ * -t file      write port trace (see trace.h, read with ledtrace),
+ * -f           fast-forward: skip INT0 ticks that only advance counters
+ *              and multiplex frames of a static display (see
+ *              fw_fast_forward()), trace then covers executed events only.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+#include "sim.h"
+#include "trace.h"
+
+#define MAX_PRESSES 64
+#define MAX_RESETS  16
+#define MAX_OUTAGES 8
+#define MAX_STOPS   8
+#define EE_JOURNAL  64
+#define MAX_BENCH   32
+#define MAX_FOLLOWERS 16
+#define MAX_LIGHTS  16
+#define SYNC_CHECKS 10
+#define SYNC_LINE   1       /* PA1 */
+#define DAY         86400.0
+#define YEAR        (365 * DAY)
+#define AGING_TAU   (30 * DAY)
+#define XTAL_REBASE (60 * SIM_HZ)  /* Crystal frequency update interval */
+#define PPS_WIDTH   0.1
+#define STARTUP     (0.064 * SIM_HZ + 14) /* lfuse 0xe4, SUT = 10 */
+#define EE_WRITE    (0.0034 * SIM_HZ)     /* Erase and write of a byte */
+#define HOLDUP      0.1
+#define OSCCAL_FACTORY 0x50
+#define RC_STEP     0.01    /* Relative RC frequency change per OSCCAL step */
+#define UART_BAUD   9600
+#define UART_FRAME  (10 * SIM_HZ / UART_BAUD) /* Start, 8 data, stop */
+#define UART_TOL    0.03    /* Baud rate mismatch still received */
+#define TEL_SYNC    0xa5    /* Telemetry frame start */
+#define TEL_FRAME   11
+#define NMEA_DELAY  0.1     /* Sentences after the PPS edge */
+#define LIGHT_LINE  0       /* PA0 */
+#define LIGHT_C     1e-6    /* Capacitor discharged by the LDR */
+#define LIGHT_R10   15e3    /* LDR at 10 lux (GL5528) */
+#define LIGHT_GAMMA 0.7     /* log(R) per log(lux) */
+#define LIGHT_VTH   0.4     /* Input low threshold, of the supply */
+
+/* Current consumption estimate, typical figures at 5 V */
+#define I_ACTIVE    0.8e-3  /* Per MHz of the CPU clock */
+#define I_IDLE      0.25e-3 /* Per MHz of the CPU clock */
+#define I_PDOWN     8e-6    /* Watchdog running */
+#define I_XTAL      20e-6   /* Crystal oscillator and the 4060 */
+#define I_SEGMENT   20e-3   /* Lit filament */
+#define I_DOTS      5e-3
+#define CYCLES_INT0 150     /* Clock tick handler */
+#define CYCLES_WAKE 40      /* Power-down wake-up handler */
+#define CYCLES_T0   60      /* Multiplex handler */
+#define CYCLES_MAIN 20      /* Main loop pass after every handler */
+#define CYCLES_UART 40      /* USART handlers */
+
+
+volatile uint8_t PORTA, DDRA, PINA;
+volatile uint8_t PORTB, DDRB, PINB;
+volatile uint8_t PORTD, DDRD, PIND;
+volatile uint8_t MCUCR, MCUSR, GIMSK, EIFR, CLKPR, OSCCAL, GPIOR0, WDTCSR;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK, TIFR;
+volatile uint8_t TCCR1A, TCCR1B;
+volatile uint16_t TCNT1, OCR1A, OCR1B, ICR1;
+volatile uint8_t ACSR;
+volatile uint8_t UCSRA, UCSRB, UCSRC, UBRRL, UBRRH;
+volatile uint16_t UDR;
+volatile unsigned char sim_sreg_i;
+
+/* Firmware memory, sections of fw.o renamed by the Makefile */
+extern char __start_fwdata[], __stop_fwdata[];
+extern char __start_fwbss[], __stop_fwbss[];
+extern char __start_fwnoinit[] __attribute__((weak));
+extern char __stop_fwnoinit[] __attribute__((weak));
+
+
+struct press {
+	double at;
+	double len;
+	int which;
+};
+
+
+struct reset {
+	double at;
+	double len;
+	uint8_t cause;
+};
+
+
+struct outage {
+	double at;
+	double len;
+	double holdup;
+	double saved;   /* Save done, first burst of EEPROM writes */
+	int saves;      /* Bytes written in the burst */
+	int writes;
+	int died;
+	int torn;
+};
+
+
+struct stop {
+	double at;
+	double len;
+};
+
+
+struct light {
+	double at;
+	double lux;
+};
+
+
+struct uart_line {
+	double at;
+	const char *text;
+	int quiet;
+};
+
+
+struct follower {
+	double ppm;
+	double offset;
+};
+
+
+struct ee_write {
+	double start;
+	int addr;
+	uint8_t old;
+};
+
+
+enum {
+	sync_none = 0,
+	sync_master,
+	sync_follower
+};
+
+
+enum {
+	ev_xtal,
+	ev_int0,
+	ev_t0_ovf,
+	ev_t0_compa,
+	ev_t0_compb,
+	ev_t1_compb,
+	ev_uart_rx,
+	ev_uart_udre,
+	ev_reset,
+	ev_end
+};
+
+
+static struct {
+	double now;
+	double end;
+	jmp_buf done;
+	int started;
+	int unset;
+	int fast;
+	int latency;        /* Handlers hold other interrupts off, [-l] */
+	long start_tod;
+
+	/* 32 kHz crystal + 4060 */
+	double xtal_ppm;
+	double xtal_tc;
+	double temp_mean;
+	double temp_swing;
+	double aging;
+	double xtal_origin;
+	double xtal_half;
+	unsigned long long xtal_edges;
+	double xtal_next;
+	int xtal_level;
+	struct stop stop[MAX_STOPS];
+	int nstop;
+
+	/* Internal RC oscillator, simulation ticks per CPU cycle */
+	int rc_model;
+	double rc_err;
+	double rc_tc;
+	double rc;
+	double rc_temp;
+	double rc_at;
+
+	/* Timer0 */
+	double t0_base;
+	double busy;        /* Running handler returns */
+	int isr;            /* Firmware code runs in a handler */
+	double t0_tick;
+	double t0_rc;
+	uint8_t t0_tccr0b;
+	uint8_t t0_clkpr;
+	uint8_t t0_ocra;
+	uint8_t t0_ocrb;
+	uint8_t t0_done;
+	uint8_t t0_late;    /* Compare flags still set at the overflow */
+
+	/* Timer1, counts and compare B */
+	double t1_base;
+	double t1_tick;
+	double t1_cnt;
+	double t1_rc;
+	uint8_t t1_tccr1b;
+	uint8_t t1_clkpr;
+
+	/* UART, lines from the host sorted by time */
+	struct uart_line *uart;
+	int nuart;
+	int uart_head;
+	int uart_pos;
+	unsigned long nmea;
+	double uart_free;
+	double uart_tx_free;
+	char uart_out[64];
+	int uart_len;
+	unsigned long uart_rx;
+	unsigned long uart_tx;
+	unsigned long uart_errors;
+	FILE *uart_file;
+	int tel_skip;
+	unsigned long tel_frames;
+
+	/* Watchdog */
+	double wdt_timeout;
+	double wdt_last;
+
+	struct press press[MAX_PRESSES];
+	int npress;
+
+	/* Resets, sorted by time */
+	struct reset reset[MAX_RESETS];
+	int nreset;
+	int hung;
+	unsigned int resets;
+	char *fwdata;
+	int dump_eeprom;
+
+	int calib_set;
+	int calib;
+	int pps;
+	int pps_seen;
+
+	/* Light profile sorted by time, capacitor discharging since */
+	struct light light[MAX_LIGHTS];
+	int nlight;
+	double light_release;
+
+	/* Sync line, master's changes are piped to the followers */
+	int sync;
+	double sync_offset;
+	int sync_out[MAX_FOLLOWERS];
+	int nsync_out;
+	int sync_drive;
+	int sync_in;
+	double sync_next;
+	int sync_bus;
+	int sync_seen;
+
+	/* Time error checkpoints */
+	const double *check;
+	double *check_err;
+	int ncheck;
+
+	uint8_t eeprom[E2END + 1];
+	unsigned long long ee_writes;
+	unsigned long ee_cell[E2END + 1];
+
+	/* Writes in progress are undone by a power loss */
+	double ee_busy;
+	double ee_spin;     /* Caller busy-waits until then, [ee_block()] */
+	struct ee_write journal[EE_JOURNAL];
+	int njournal;
+
+	struct outage outage[MAX_OUTAGES];
+	int noutage;
+
+	const char *trace_path;
+	struct trace_writer trace;
+
+	unsigned long long int0_cnt;
+	unsigned long long int0_lost;
+	int int0_pending;
+	unsigned long long t0_cnt;
+	unsigned long long t1_isrs;
+
+	/* Charge in A times simulation ticks, [supply_ok()] */
+	int pdown;
+	double cpu_acc;
+	double q_cpu[2];
+	double q_led[2];
+	double span[2];
+	double t_active;
+	double t_pdown;
+	double t_slow;
+	double q_full;
+	double led_i;
+	double led_acc;
+	double q_seg;
+	double led_frame;
+	double led_mark;
+	unsigned long led_ovf;
+	int led_steady;
+} sim;
+
+
+/* avr-libc writes the whole WDTCSR, interrupt mode is off */
+void sim_wdt_enable(unsigned char timeout)
+{
+	WDTCSR &= ~(1 << WDIE);
+	sim.wdt_timeout = SIM_HZ * (16 << timeout) / 1000;
+	sim.wdt_last = sim.now;
+}
+
+
+void sim_wdt_reset(void)
+{
+	sim.wdt_last = sim.now;
+}
+
+
+/* Waits for the write in progress, once the caller's own ones started */
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+	double at = sim.ee_spin > sim.now ? sim.ee_spin : sim.now;
+
+	for (int i = 0; i < sim.njournal; ++i) {
+		double end = sim.journal[i].start + EE_WRITE;
+
+		if (sim.journal[i].start <= at && end > at && end > sim.ee_spin)
+			sim.ee_spin = end;
+	}
+
+	return sim.eeprom[(uintptr_t)addr & E2END];
+}
+
+
+static struct outage *outage_now(void)
+{
+	for (int i = 0; i < sim.noutage; ++i) {
+		struct outage *o = &sim.outage[i];
+
+		if (sim.now >= o->at && sim.now < o->at + o->len)
+			return o;
+	}
+
+	return NULL;
+}
+
+
+/* Writes are queued as the MCU busy-waits between them, the caller
+ * returns once its last one started */
+void eeprom_write_byte(uint8_t *addr, uint8_t val)
+{
+	int a = (uintptr_t)addr & E2END, n = 0;
+	double start = sim.ee_busy > sim.now ? sim.ee_busy : sim.now;
+	struct outage *o;
+
+	for (int i = 0; i < sim.njournal; ++i) {
+		if (sim.journal[i].start + EE_WRITE > sim.now)
+			sim.journal[n++] = sim.journal[i];
+	}
+	sim.njournal = n < EE_JOURNAL ? n : EE_JOURNAL - 1;
+
+	sim.journal[sim.njournal].start = start;
+	sim.journal[sim.njournal].addr = a;
+	sim.journal[sim.njournal].old = sim.eeprom[a];
+	++sim.njournal;
+
+	sim.eeprom[a] = val;
+	sim.ee_busy = start + EE_WRITE;
+	sim.ee_spin = start;
+	++sim.ee_writes;
+	++sim.ee_cell[a];
+
+	if ((o = outage_now()) != NULL) {
+		if (!o->writes || start <= o->saved) {
+			o->saved = sim.ee_busy;
+			++o->saves;
+		}
+		++o->writes;
+	}
+}
+
+
+/* Interrupted write leaves the byte erased, queued ones never happen */
+static void eeprom_power_loss(void)
+{
+	struct outage *o = outage_now();
+
+	if (o != NULL) {
+		o->died = 1;
+		o->torn = sim.ee_busy > sim.now;
+	}
+
+	for (int i = sim.njournal - 1; i >= 0; --i) {
+		const struct ee_write *w = &sim.journal[i];
+
+		if (w->start + EE_WRITE > sim.now)
+			sim.eeprom[w->addr] = w->start < sim.now ? 0xff : w->old;
+	}
+
+	sim.njournal = 0;
+	sim.ee_busy = sim.now;
+}
+
+
+static double temperature(double t)
+{
+	double tod = fmod(sim.start_tod + t / SIM_HZ, DAY);
+
+	return sim.temp_mean + sim.temp_swing * sin(2 * M_PI * (tod - 9 * 3600) / DAY);
+}
+
+
+/* Crystal frequency error at time t, fixed offset, tuning
+ * fork parabola around 25 C and aging */
+static double xtal_ppm(double t)
+{
+	double s = t / SIM_HZ;
+	double temp = temperature(t);
+
+	return sim.xtal_ppm + sim.xtal_tc * (temp - 25) * (temp - 25) +
+		sim.aging * log1p(s / AGING_TAU) / log1p(YEAR / AGING_TAU);
+}
+
+
+static int xtal_varies(void)
+{
+	return sim.temp_swing != 0 || sim.aging != 0;
+}
+
+
+static double xtal_half_period(double t)
+{
+	return SIM_HZ / (2 * XTAL_HZ * (1 + xtal_ppm(t) * 1e-6));
+}
+
+
+/* Edges are counted from origin, so rounding errors don't accumulate */
+static void xtal_advance(unsigned long long edges)
+{
+	sim.xtal_edges += edges;
+	sim.xtal_next = sim.xtal_origin + (sim.xtal_edges + 1) * sim.xtal_half;
+
+	if (xtal_varies() && sim.xtal_next - sim.xtal_origin > XTAL_REBASE) {
+		sim.xtal_half = xtal_half_period(sim.xtal_next);
+		sim.xtal_origin = sim.xtal_next - sim.xtal_half;
+		sim.xtal_edges = 0;
+	}
+}
+
+
+static const int prescaler[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+
+/* RC frequency follows OSCCAL and the temperature (updated every second) */
+static void rc_update(void)
+{
+	if (!sim.rc_model)
+		return;
+
+	if (sim.now >= sim.rc_at) {
+		sim.rc_temp = sim.rc_tc * (temperature(sim.now) - 25);
+		sim.rc_at = sim.now + SIM_HZ;
+	}
+
+	sim.rc = 1 / (1 + (sim.rc_err + sim.rc_temp) / 100 + (OSCCAL - OSCCAL_FACTORY) * RC_STEP);
+}
+
+
+static double t0_tick(void)
+{
+	return prescaler[TCCR0B & 7] * (1 << (CLKPR & 0xf)) * sim.rc;
+}
+
+
+/* Keeps Timer0 counter value over clock source changes */
+static void t0_update(void)
+{
+	double tick;
+
+	if (TCCR0B == sim.t0_tccr0b && CLKPR == sim.t0_clkpr && sim.rc == sim.t0_rc)
+		return;
+
+	tick = t0_tick();
+
+	if (sim.t0_tick != 0)
+		sim.t0_base = sim.now - (sim.now - sim.t0_base) / sim.t0_tick * tick;
+	else {
+		sim.t0_base = sim.now;
+		sim.t0_ocra = OCR0A;
+		sim.t0_ocrb = OCR0B;
+		sim.t0_done = 0;
+		sim.t0_late = 0;
+	}
+
+	sim.t0_tick = tick;
+	sim.t0_rc = sim.rc;
+	sim.t0_tccr0b = TCCR0B;
+	sim.t0_clkpr = CLKPR;
+}
+
+
+static double t1_count(void)
+{
+	return sim.t1_cnt + (sim.t1_tick != 0 ? (sim.now - sim.t1_base) / sim.t1_tick : 0);
+}
+
+
+static void t1_update(void)
+{
+	if (TCCR1B == sim.t1_tccr1b && CLKPR == sim.t1_clkpr && sim.rc == sim.t1_rc)
+		return;
+
+	sim.t1_cnt = fmod(t1_count(), 65536);
+	sim.t1_base = sim.now;
+	sim.t1_tick = prescaler[TCCR1B & 7] * (1 << (CLKPR & 0xf)) * sim.rc;
+	sim.t1_rc = sim.rc;
+	sim.t1_tccr1b = TCCR1B;
+	sim.t1_clkpr = CLKPR;
+}
+
+
+/* Timers follow the CPU clock */
+static void timers_update(void)
+{
+	rc_update();
+	t0_update();
+	t1_update();
+}
+
+
+/* Time of the next compare match */
+static double t1_match(uint16_t ocr)
+{
+	double cnt = floor(t1_count());
+	double k = cnt + fmod(ocr - fmod(cnt, 65536) + 65535, 65536) + 1;
+
+	return sim.t1_base + (k - sim.t1_cnt) * sim.t1_tick;
+}
+
+
+static int xtal_stopped(void)
+{
+	for (int i = 0; i < sim.nstop; ++i) {
+		if (sim.now >= sim.stop[i].at && sim.now < sim.stop[i].at + sim.stop[i].len)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/* Firmware baud rate, from the CPU clock */
+static double uart_baud(void)
+{
+	int div = UCSRA & (1 << U2X) ? 8 : 16;
+
+	return SIM_HZ / (sim.rc * (1 << (CLKPR & 0xf)) * div * (((UBRRH << 8) | UBRRL) + 1));
+}
+
+
+static int uart_baud_ok(void)
+{
+	return fabs(uart_baud() / UART_BAUD - 1) < UART_TOL;
+}
+
+
+/* Time the next byte from the host is received */
+static double uart_rx_next(void)
+{
+	const struct uart_line *l = &sim.uart[sim.uart_head];
+
+	if (sim.uart_head == sim.nuart)
+		return INFINITY;
+
+	return (l->at > sim.uart_free ? l->at : sim.uart_free) + UART_FRAME;
+}
+
+
+/* Byte the firmware wrote to UDR goes out */
+static void uart_sample(void)
+{
+	uint8_t c = UDR;
+
+	if (UDR & 0x100)
+		return;
+
+	UDR = 0x100;
+	++sim.uart_tx;
+	sim.uart_tx_free = sim.now + 10 * SIM_HZ / uart_baud();
+
+	if (!(UCSRB & (1 << TXEN)))
+		return;
+
+	if (!uart_baud_ok()) {
+		++sim.uart_errors;
+		c = '~';
+	}
+
+	if (sim.uart_file != NULL)
+		fputc(c, sim.uart_file);
+
+	/* Binary frames don't belong to the lines */
+	if (sim.tel_skip) {
+		--sim.tel_skip;
+		return;
+	}
+	if (c == TEL_SYNC) {
+		sim.tel_skip = TEL_FRAME - 1;
+		++sim.tel_frames;
+		return;
+	}
+
+	if (c == '\n') {
+		printf("uart:        %.3f s < %.*s\n", sim.now / SIM_HZ, sim.uart_len, sim.uart_out);
+		sim.uart_len = 0;
+	}
+	else if (c != '\r' && sim.uart_len < sizeof(sim.uart_out))
+		sim.uart_out[sim.uart_len++] = c;
+}
+
+
+static int button_pressed(int which)
+{
+	for (int i = 0; i < sim.npress; ++i) {
+		if (sim.press[i].which == which && sim.now >= sim.press[i].at &&
+				sim.now < sim.press[i].at + sim.press[i].len)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+static int supply_ok(void)
+{
+	return outage_now() == NULL;
+}
+
+
+static int pps_level(void)
+{
+	return sim.pps && fmod(sim.now / SIM_HZ, 1) < PPS_WIDTH;
+}
+
+
+static double light_lux(void)
+{
+	const struct light *a = sim.light, *b;
+	int i;
+
+	for (i = 1; i < sim.nlight && sim.light[i].at <= sim.now; ++i)
+		;
+	a = &sim.light[i - 1];
+	if (i == sim.nlight || sim.now <= a->at)
+		return a->lux;
+
+	b = &sim.light[i];
+	return a->lux * pow(b->lux / a->lux, (sim.now - a->at) / (b->at - a->at));
+}
+
+
+/* Capacitor above the input threshold, RC discharge through the LDR */
+static int light_level(void)
+{
+	double r = LIGHT_R10 * pow(light_lux() / 10, -LIGHT_GAMMA);
+
+	return sim.now - sim.light_release < -log(LIGHT_VTH) * r * LIGHT_C * SIM_HZ;
+}
+
+
+/* Driven high charges the capacitor at once, low empties it */
+static void light_update(void)
+{
+	if (!sim.nlight)
+		return;
+
+	if (DDRA & PORTA & (1 << LIGHT_LINE))
+		sim.light_release = INFINITY;
+	else if (DDRA & (1 << LIGHT_LINE))
+		sim.light_release = -INFINITY;
+	else if (sim.light_release == INFINITY)
+		sim.light_release = sim.now;
+}
+
+
+static void sync_fetch(void)
+{
+	if (read(sim.sync_in, &sim.sync_next, sizeof(sim.sync_next)) != sizeof(sim.sync_next))
+		sim.sync_next = INFINITY;
+}
+
+
+/* Follower, line level set by the master. Blocks until the master
+ * got past now (or finished). */
+static int sync_level(void)
+{
+	while (sim.sync_next <= sim.now) {
+		sim.sync_bus = !sim.sync_bus;
+		sync_fetch();
+	}
+
+	return sim.sync_bus;
+}
+
+
+static int sync_low(void)
+{
+	if (DDRA & ~PORTA & (1 << SYNC_LINE))
+		return 1;
+
+	return sim.sync == sync_follower && !sync_level();
+}
+
+
+/* Master, every change of its drive goes to the followers */
+static void sync_update(void)
+{
+	int low = (DDRA & ~PORTA & (1 << SYNC_LINE)) != 0;
+
+	if (sim.sync != sync_master || low == sim.sync_drive)
+		return;
+
+	sim.sync_drive = low;
+	for (int i = 0; i < sim.nsync_out; ++i) {
+		/* Follower that finished doesn't read any more */
+		if (write(sim.sync_out[i], &sim.now, sizeof(sim.now)) < 0 && errno != EPIPE)
+			perror("sync");
+	}
+}
+
+
+/* Time until the next external input event, 0 if one is active now */
+static double inputs_idle(void)
+{
+	double t = sim.end - sim.now;
+
+	/* Tick handler hasn't seen the edge yet */
+	if (pps_level() != sim.pps_seen)
+		return 0;
+
+	if (sim.sync == sync_follower) {
+		if (sync_level() != sim.sync_seen)
+			return 0;
+		if (sim.sync_next - sim.now < t)
+			t = sim.sync_next - sim.now;
+	}
+
+	if (sim.pps) {
+		double phase = fmod(sim.now, SIM_HZ);
+		double edge = (phase < PPS_WIDTH * SIM_HZ ? PPS_WIDTH * SIM_HZ : SIM_HZ) - phase;
+
+		if (edge < t)
+			t = edge;
+	}
+
+	if (sim.ncheck && sim.check[0] - sim.now < t)
+		t = sim.check[0] - sim.now;
+
+	if (UCSRB & (1 << UDRIE))
+		return 0;
+	if (uart_rx_next() - sim.now < t)
+		t = uart_rx_next() - sim.now;
+
+	if (sim.nreset && sim.reset[0].at - sim.now < t)
+		t = sim.reset[0].at - sim.now;
+
+	for (int i = 0; i < sim.nstop; ++i) {
+		double at = sim.stop[i].at - sim.now;
+
+		if (at <= 0 && at + sim.stop[i].len > 0)
+			return 0;
+		if (at > 0 && at < t)
+			t = at;
+	}
+
+	for (int i = 0; i < sim.noutage; ++i) {
+		double at = sim.outage[i].at - sim.now;
+
+		if (at <= 0 && at + sim.outage[i].len > 0)
+			return 0;
+		if (at > 0 && at < t)
+			t = at;
+	}
+
+	for (int i = 0; i < sim.npress; ++i) {
+		double at = sim.press[i].at - sim.now;
+
+		if (at <= 0 && at + sim.press[i].len > 0)
+			return 0;
+		if (at > 0 && at < t)
+			t = at;
+	}
+
+	return t;
+}
+
+
+/* CPU clock in MHz */
+static double cpu_mhz(void)
+{
+	return SIM_HZ / 1e6 / (1 << (CLKPR & 0xf)) / sim.rc;
+}
+
+
+/* CPU slept from the last accounted moment until now */
+static void account_sleep(void)
+{
+	double dt = sim.now - sim.cpu_acc;
+	int ok = supply_ok();
+
+	if (dt <= 0)
+		return;
+
+	if (sim.pdown) {
+		sim.q_cpu[ok] += dt * I_PDOWN;
+		sim.q_full += dt * I_PDOWN;
+		sim.t_pdown += dt;
+	}
+	else {
+		sim.q_cpu[ok] += dt * I_IDLE * cpu_mhz();
+		sim.q_full += dt * I_IDLE * SIM_HZ / 1e6;
+	}
+
+	if (CLKPR & 0xf)
+		sim.t_slow += dt;
+
+	sim.span[ok] += dt;
+	sim.cpu_acc = sim.now;
+}
+
+
+static void account_run(double cycles)
+{
+	double dt = cycles * (1 << (CLKPR & 0xf)) * sim.rc;
+	int ok = supply_ok();
+
+	sim.q_cpu[ok] += dt * I_ACTIVE * cpu_mhz();
+	sim.t_active += dt;
+
+	/* Same work at the full speed, idle for the rest */
+	sim.q_full += (cycles * I_ACTIVE + (dt - cycles) * I_IDLE) * SIM_HZ / 1e6;
+	if (CLKPR & 0xf)
+		sim.t_slow += dt;
+
+	sim.span[ok] += dt;
+	sim.cpu_acc += dt;
+}
+
+
+/* Firmware code just run busy-waited on the EEPROM. A handler
+ * holds the other interrupts off meanwhile. */
+static void ee_block(void)
+{
+	double dt = sim.ee_spin - sim.now;
+
+	sim.ee_spin = 0;
+	if (dt <= 0)
+		return;
+
+	account_run(dt / ((1 << (CLKPR & 0xf)) * sim.rc));
+	if (sim.isr && sim.latency)
+		sim.busy += dt;
+}
+
+
+/* Digit drivers are PNPs (active low), segments go through ULN2003.
+ * Dots (PB7) don't have a digit driver, they're lit in one slot */
+static void led_current(void)
+{
+	int digits = __builtin_popcount(~PORTD & DDRD & (0xf << 3));
+
+	sim.led_i = digits * __builtin_popcount(PORTB & DDRB & 0x7f) * I_SEGMENT +
+		(PORTB & DDRB & 0x80 ? I_DOTS : 0);
+}
+
+
+/* Skips may have accounted ahead of now already */
+static void account_leds(void)
+{
+	double seg = 0;
+
+	if (sim.now > sim.led_acc) {
+		seg = (sim.now - sim.led_acc) * sim.led_i;
+		sim.q_seg += seg;
+		sim.led_acc = sim.now;
+	}
+
+	sim.q_led[supply_ok()] += seg;
+}
+
+
+/* Fast-forward over INT0 ticks starting with the current rising edge */
+static int xtal_skip(void)
+{
+	double period = 2 * sim.xtal_half;
+	long n = inputs_idle() / period;
+
+	if (n <= 0 || (n = fw_fast_forward(n)) == 0)
+		return 0;
+
+	account_sleep();
+	account_run(n * (CYCLES_INT0 + CYCLES_MAIN));
+
+	/* Frames go on, over skipped whole seconds they keep the dots
+	 * of the last one (a slot of one LED pair, under 1% of the total) */
+	sim.int0_cnt += n;
+	sim.wdt_last = sim.now + (n - 1) * period;
+	xtal_advance(2 * n);
+
+	return 1;
+}
+
+
+/* Skips whole multiplex frames of a static display before the next INT0 */
+static int t0_skip(double t, double until)
+{
+	double frame = 4 * 256 * sim.t0_tick;
+	double n = floor((until - t) / frame), seg;
+	int isrs = 4 * __builtin_popcount(TIMSK & ((1 << TOIE0) | (1 << OCIE0A) | (1 << OCIE0B)));
+
+	if (n < 1 || sim.t0_late || !fw_display_static() || sim.led_steady < 2)
+		return 0;
+
+	/* Ports don't change until t, then frames repeat the last one */
+	seg = (t - sim.led_acc) * sim.led_i + n * sim.led_frame;
+	sim.q_seg += seg;
+	sim.q_led[supply_ok()] += seg;
+	sim.led_mark += n * sim.led_frame;
+	sim.led_acc = t + n * frame;
+	account_run(n * isrs * (CYCLES_T0 + CYCLES_MAIN));
+
+	sim.t0_base += n * frame;
+	sim.t0_cnt += n * isrs;
+
+	return 1;
+}
+
+
+/* Charge of the last multiplex frame, repeated by t0_skip() */
+static void led_frame(void)
+{
+	if (++sim.led_ovf % 4)
+		return;
+
+	/* Frame counts once it started with the display static already */
+	if (!fw_display_static())
+		sim.led_steady = 0;
+	else if (sim.led_steady < 2)
+		++sim.led_steady;
+
+	sim.led_frame = sim.q_seg - sim.led_mark;
+	sim.led_mark = sim.q_seg;
+}
+
+
+static void ports_get(uint8_t *val)
+{
+	val[0] = PORTA;
+	val[1] = PORTB;
+	val[2] = PORTD;
+}
+
+
+static void dispatch(void (*isr)(void), double cycles)
+{
+	uint8_t val[TRACE_CHANNELS];
+
+	account_sleep();
+	account_leds();
+
+	/* Inputs as seen by the handler */
+	PINA = (PORTA & DDRA) | (~DDRA & PORTA & ~3) | (supply_ok() << 1) |
+		(sim.nlight ? light_level() : pps_level()) << LIGHT_LINE;
+	if (sim.sync && sync_low())
+		PINA &= ~(1 << SYNC_LINE);
+	if (isr == INT0_vect) {
+		sim.pps_seen = pps_level();
+		if (sim.sync == sync_follower)
+			sim.sync_seen = sync_level();
+	}
+	PIND = (PORTD & DDRD) | (~DDRD & 0x78) | (sim.xtal_level << 2);
+	for (int i = 0; i < 2; ++i) {
+		if (!button_pressed(i))
+			PIND |= 1 << i;
+	}
+
+	/* Counter may have wrapped while the event waited */
+	if (sim.t0_tick != 0)
+		TCNT0 = (unsigned long)((sim.now - sim.t0_base) / sim.t0_tick);
+	TCNT1 = (unsigned long)t1_count();
+	UCSRA &= ~(1 << UDRE);
+	UCSRA |= (sim.now >= sim.uart_tx_free) << UDRE;
+
+	if (sim.latency)
+		sim.busy = sim.now + cycles * (1 << (CLKPR & 0xf)) * sim.rc;
+	sim.isr = 1;
+	isr();
+	ee_block();
+	sim.isr = 0;
+
+	uart_sample();
+	sync_update();
+	light_update();
+
+	account_run(cycles + CYCLES_MAIN);
+	led_current();
+
+	timers_update();
+
+	if (sim.trace.f != NULL) {
+		ports_get(val);
+		trace_write(&sim.trace, (uint64_t)(sim.now + 0.5), val);
+	}
+}
+
+
+/* SRAM content is random after power-up */
+static void power_on(void)
+{
+	for (char *p = __start_fwnoinit; p < __stop_fwnoinit; ++p)
+		*p = rand();
+
+	MCUSR = 1 << PORF;
+	OSCCAL = OSCCAL_FACTORY;
+	UCSRC = (1 << 2) | (1 << 1);
+	UDR = 0x100;
+}
+
+
+/* Resets the MCU and restarts the firmware once the reset is
+ * released and start-up delay passes, crystal keeps running */
+static void reset(uint8_t cause, double len)
+{
+	uint8_t val[TRACE_CHANNELS];
+	double boot = sim.now + len + STARTUP;
+
+	++sim.resets;
+	sim.hung = 0;
+
+	/* MCU draws next to nothing in reset or without supply */
+	account_sleep();
+	account_leds();
+	sim.led_i = 0;
+	sim.led_steady = 0;
+
+	PORTA = DDRA = PORTB = DDRB = PORTD = DDRD = 0;
+	MCUCR = GIMSK = EIFR = CLKPR = GPIOR0 = WDTCSR = 0;
+	TCCR0A = TCCR0B = TCNT0 = OCR0A = OCR0B = TIMSK = TIFR = 0;
+	TCCR1A = TCCR1B = ACSR = 0;
+	UCSRA = UCSRB = UBRRL = UBRRH = 0;
+	UCSRC = (1 << 2) | (1 << 1);
+	UDR = 0x100;
+	TCNT1 = OCR1A = OCR1B = ICR1 = 0;
+	OSCCAL = OSCCAL_FACTORY;
+	sim_sreg_i = 0;
+	sim.wdt_timeout = 0;
+	sim.t1_cnt = sim.t1_tick = 0;
+	sim.isr = sim.int0_pending = 0;
+	sim.busy = sim.ee_spin = 0;
+	timers_update();
+
+	memcpy(__start_fwdata, sim.fwdata, __stop_fwdata - __start_fwdata);
+	memset(__start_fwbss, 0, __stop_fwbss - __start_fwbss);
+
+	if (cause & (1 << PORF)) {
+		eeprom_power_loss();
+		power_on();
+	}
+	else
+		MCUSR |= cause;
+
+	sync_update();
+
+	if (sim.trace.f != NULL) {
+		ports_get(val);
+		trace_write(&sim.trace, (uint64_t)(sim.now + 0.5), val);
+	}
+
+	while (sim.xtal_next < boot) {
+		unsigned long long n = (boot - sim.xtal_next) / sim.xtal_half + 1;
+
+		sim.xtal_level ^= n & 1;
+		xtal_advance(n);
+	}
+
+	sim.now = boot;
+	sim.cpu_acc = sim.led_acc = boot;
+	longjmp(sim.done, 2);
+}
+
+
+/* Vectors the firmware doesn't use, avr-libc jumps to the reset vector */
+void __attribute__((weak)) TIMER1_COMPB_vect(void)
+{
+	reset(0, 0);
+}
+
+
+void __attribute__((weak)) WDT_OVERFLOW_vect(void)
+{
+	reset(0, 0);
+}
+
+
+void __attribute__((weak)) USART_RX_vect(void)
+{
+	reset(0, 0);
+}
+
+
+void __attribute__((weak)) USART_UDRE_vect(void)
+{
+	reset(0, 0);
+}
+
+
+/* Earliest scheduled reset or the watchdog timeout */
+static double reset_next(void)
+{
+	double t = INFINITY;
+
+	if (sim.nreset)
+		t = sim.reset[0].at;
+
+	if (sim.wdt_timeout != 0 && sim.wdt_last + sim.wdt_timeout < t)
+		t = sim.wdt_last + sim.wdt_timeout;
+
+	return t;
+}
+
+
+/* Returns 1 if the watchdog interrupt ran instead of a reset */
+static int reset_event(void)
+{
+	struct reset r;
+
+	if (!sim.nreset || sim.reset[0].at > sim.now) {
+		/* Interrupt mode is used up, next timeout resets */
+		if (!(WDTCSR & (1 << WDIE)))
+			reset(1 << WDRF, 0);
+
+		WDTCSR &= ~(1 << WDIE);
+		sim.wdt_last = sim.now;
+		if (sim.hung)
+			return 0;
+
+		dispatch(WDT_OVERFLOW_vect, CYCLES_INT0);
+		return 1;
+	}
+
+	r = sim.reset[0];
+	memmove(sim.reset, sim.reset + 1, --sim.nreset * sizeof(r));
+
+	/* Watchdog reset is caused by a hang */
+	if (r.cause == (1 << WDRF))
+		sim.hung = 1;
+	else
+		reset(r.cause, r.len);
+
+	return 0;
+}
+
+
+/* Earliest pending Timer0 event, ties resolved by vector priority.
+ * The multiplex depends on their latency (-l): they wait for the
+ * running handler to return and then the ones due by then run in
+ * vector priority order, an overflow before a late compare match.
+ * Off by default, the jitter keeps trace frames from repeating. */
+static double t0_next(int *ev)
+{
+	static const int evs[3] = { ev_t0_ovf, ev_t0_compa, ev_t0_compb };
+	double t[3], first;
+	int i;
+
+	t[0] = sim.t0_base + 256 * sim.t0_tick;
+	t[1] = sim.t0_base + sim.t0_ocra * sim.t0_tick;
+	t[2] = sim.t0_base + sim.t0_ocrb * sim.t0_tick;
+
+	for (i = 1; i < 3; ++i) {
+		if (sim.t0_late & i)
+			t[i] = sim.t0_base;
+		else if (sim.t0_done & i)
+			t[i] = INFINITY;
+	}
+
+	first = t[0] < t[1] ? t[0] : t[1];
+	if (t[2] < first)
+		first = t[2];
+	if (first < sim.busy)
+		first = sim.busy;
+
+	for (i = 0; t[i] > first; ++i)
+		;
+
+	*ev = evs[i];
+
+	return first;
+}
+
+
+static int next_event(double *t)
+{
+	int ev = ev_xtal, t0_ev;
+	double t0, until;
+
+	*t = sim.xtal_next;
+
+	/* Flag set while a handler ran */
+	if (sim.int0_pending && sim.busy < *t) {
+		*t = sim.busy > sim.now ? sim.busy : sim.now;
+		ev = ev_int0;
+	}
+
+	if (sim.t1_tick != 0 && (TIMSK & (1 << OCIE1B))) {
+		double t1 = t1_match(OCR1B);
+
+		if (t1 < *t) {
+			*t = t1;
+			ev = ev_t1_compb;
+		}
+	}
+
+	if (uart_rx_next() < *t) {
+		*t = uart_rx_next();
+		ev = ev_uart_rx;
+	}
+
+	/* Hung CPU never takes the byte */
+	if (!sim.hung && (UCSRB & (1 << UDRIE)) && (UCSRB & (1 << TXEN)) && sim.uart_tx_free < *t) {
+		*t = sim.uart_tx_free > sim.now ? sim.uart_tx_free : sim.now;
+		ev = ev_uart_udre;
+	}
+
+	if (sim.t0_tick != 0) {
+		t0 = t0_next(&t0_ev);
+		until = *t < sim.end ? *t : sim.end;
+
+		if (sim.fast && !sim.hung && t0_skip(t0, until))
+			t0 = t0_next(&t0_ev);
+
+		if (t0 < *t) {
+			*t = t0;
+			ev = t0_ev;
+		}
+	}
+
+	if (sim.end <= *t) {
+		*t = sim.end;
+		ev = ev_end;
+	}
+
+	return ev;
+}
+
+
+static int int0_triggered(void)
+{
+	if (!(GIMSK & (1 << INT0)))
+		return 0;
+
+	/* Edges are detected with the I/O clock only */
+	if (sim.pdown && (MCUCR & ((1 << ISC01) | (1 << ISC00))))
+		return 0;
+
+	switch (MCUCR & ((1 << ISC01) | (1 << ISC00))) {
+		case 1 << ISC00:
+			return 1;
+		case 1 << ISC01:
+			return !sim.xtal_level;
+		case (1 << ISC01) | (1 << ISC00):
+			return sim.xtal_level;
+		default:
+			return !sim.xtal_level;
+	}
+}
+
+
+static void start(void)
+{
+	struct fw_time t;
+	double day = fmod(sim.start_tod + sim.sync_offset + DAY, DAY);
+	long tod = day;
+
+	sim.started = 1;
+
+	if (sim.calib_set)
+		fw_set_calib(sim.calib);
+
+	if (sim.sync)
+		fw_set_sync(sim.sync == sync_master);
+
+	if (sim.unset)
+		return;
+
+	t.hours = tod / 3600;
+	t.minutes = tod / 60 % 60;
+	t.seconds = tod % 60;
+	t.subseconds = (day - tod) * XTAL_HZ;
+	t.set = 1;
+	fw_set_time(&t);
+}
+
+
+static double tod_error(void)
+{
+	struct fw_time t;
+	double fw, real, err;
+
+	fw_get_time(&t);
+	fw = t.hours * 3600.0 + t.minutes * 60 + t.seconds + t.subseconds / XTAL_HZ;
+	real = sim.start_tod + sim.now / SIM_HZ;
+
+	err = fw - real;
+	err -= 86400 * (long)(err / 86400);
+	if (err >= 43200)
+		err -= 86400;
+	else if (err < -43200)
+		err += 86400;
+
+	return err;
+}
+
+
+void sim_sleep(void)
+{
+	double t;
+
+	if (!sim.started)
+		start();
+
+	ee_block();
+
+	/* Timers could have been started by the main code */
+	timers_update();
+	uart_sample();
+
+	sim.pdown = (MCUCR & (1 << SM0)) != 0;
+
+	/* Nothing but a reset wakes the CPU with interrupts off */
+	if (!sim_sreg_i)
+		sim.hung = 1;
+
+	/* Low level keeps INT0 pending, the handler runs again */
+	if (!sim.hung && !(MCUCR & ((1 << ISC01) | (1 << ISC00))) && int0_triggered()) {
+		if (sim.cpu_acc > sim.now)
+			sim.now = sim.cpu_acc;
+		++sim.int0_cnt;
+		dispatch(INT0_vect, CYCLES_WAKE);
+		return;
+	}
+
+	/* Run until any interrupt wakes the CPU up */
+	while (1) {
+		int ev = next_event(&t);
+		double r = reset_next();
+
+		if (r < t) {
+			t = r;
+			ev = ev_reset;
+		}
+
+		while (sim.ncheck && sim.check[0] <= t) {
+			sim.now = *sim.check++;
+			*sim.check_err++ = tod_error();
+			--sim.ncheck;
+		}
+
+		sim.now = t;
+
+		switch (ev) {
+			case ev_xtal:
+				if (sim.fast && !sim.hung && !sim.xtal_level && sim.now >= sim.busy && xtal_skip())
+					break;
+
+				/* No edges, the level stays */
+				if (xtal_stopped()) {
+					xtal_advance(1);
+					break;
+				}
+
+				sim.xtal_level = !sim.xtal_level;
+				xtal_advance(1);
+				if (!sim.hung && int0_triggered()) {
+					int wake = !(MCUCR & ((1 << ISC01) | (1 << ISC00)));
+
+					/* Handler holds it off, one more edge meanwhile is lost */
+					if (sim.now < sim.busy) {
+						sim.int0_lost += sim.int0_pending;
+						sim.int0_pending = 1;
+						break;
+					}
+
+					++sim.int0_cnt;
+					dispatch(INT0_vect, wake ? CYCLES_WAKE : CYCLES_INT0);
+					return;
+				}
+				break;
+
+			case ev_int0:
+				sim.int0_pending = 0;
+				if (!sim.hung) {
+					++sim.int0_cnt;
+					dispatch(INT0_vect, CYCLES_INT0);
+					return;
+				}
+				break;
+
+			case ev_t0_ovf:
+				sim.t0_base += 256 * sim.t0_tick;
+				sim.t0_ocra = OCR0A;
+				sim.t0_ocrb = OCR0B;
+				sim.t0_late = sim.latency ? ~sim.t0_done & 3 : 0;
+				sim.t0_done = 0;
+				if (!sim.hung && (TIMSK & (1 << TOIE0))) {
+					++sim.t0_cnt;
+					dispatch(TIMER0_OVF_vect, CYCLES_T0);
+					led_frame();
+					return;
+				}
+				break;
+
+			case ev_t0_compa:
+				if (sim.t0_late & 1)
+					sim.t0_late &= ~1;
+				else
+					sim.t0_done |= 1;
+				if (!sim.hung && (TIMSK & (1 << OCIE0A))) {
+					++sim.t0_cnt;
+					dispatch(TIMER0_COMPA_vect, CYCLES_T0);
+					return;
+				}
+				break;
+
+			case ev_t0_compb:
+				if (sim.t0_late & 2)
+					sim.t0_late &= ~2;
+				else
+					sim.t0_done |= 2;
+				if (!sim.hung && (TIMSK & (1 << OCIE0B))) {
+					++sim.t0_cnt;
+					dispatch(TIMER0_COMPB_vect, CYCLES_T0);
+					return;
+				}
+				break;
+
+			case ev_t1_compb:
+				/* Counter is exactly at the match */
+				sim.t1_cnt = OCR1B;
+				sim.t1_base = sim.now;
+				if (!sim.hung) {
+					++sim.t1_isrs;
+					dispatch(TIMER1_COMPB_vect, CYCLES_INT0);
+					return;
+				}
+				break;
+
+			case ev_uart_rx: {
+				struct uart_line *l = &sim.uart[sim.uart_head];
+				uint8_t c = l->text[sim.uart_pos] ? l->text[sim.uart_pos] : '\r';
+
+				if (!sim.uart_pos && !l->quiet)
+					printf("uart:        %.3f s > %s\n", (sim.now - UART_FRAME) / SIM_HZ, l->text);
+
+				sim.uart_free = sim.now;
+				if (!l->text[sim.uart_pos++]) {
+					++sim.uart_head;
+					sim.uart_pos = 0;
+				}
+
+				if (!sim.hung && (UCSRB & (1 << RXEN)) && (UCSRB & (1 << RXCIE))) {
+					++sim.uart_rx;
+					if (!uart_baud_ok()) {
+						++sim.uart_errors;
+						UCSRA |= 1 << FE;
+					}
+					UDR = 0x100 | c;
+					dispatch(USART_RX_vect, CYCLES_UART);
+					UCSRA &= ~(1 << FE);
+					return;
+				}
+				break;
+			}
+
+			case ev_uart_udre:
+				if (!sim.hung) {
+					dispatch(USART_UDRE_vect, CYCLES_UART);
+					return;
+				}
+				break;
+
+			case ev_reset:
+				if (reset_event())
+					return;
+				break;
+
+			default:
+				longjmp(sim.done, 1);
+		}
+	}
+}
+
+
+/* Runs the firmware until the end of simulation, resets restart it */
+static void run(void)
+{
+	if (setjmp(sim.done) != 1)
+		fw_main();
+}
+
+
+static void eeprom_dump(void)
+{
+	for (int i = 0; i <= E2END; ++i) {
+		if (i % 16 == 0)
+			printf("eeprom %02x:", i);
+		printf(" %02x", sim.eeprom[i]);
+		if (i % 16 == 15)
+			putchar('\n');
+	}
+}
+
+
+static void report(double wall)
+{
+	struct fw_time t;
+	unsigned long cell = 0;
+	double span, cpu, led;
+
+	account_sleep();
+	account_leds();
+	span = sim.span[0] + sim.span[1];
+	cpu = sim.q_cpu[0] + sim.q_cpu[1];
+	led = sim.q_led[0] + sim.q_led[1];
+
+	fw_get_time(&t);
+
+	printf("simulated:   %.3f s in %.3f s\n", sim.now / SIM_HZ, wall);
+	printf("clock:       %02d:%02d:%02d+%04d/%d%s\n", t.hours, t.minutes,
+		t.seconds, t.subseconds, (int)XTAL_HZ, !t.set ? " (not set)" : t.set > 1 ? " (approximate)" : "");
+	printf("error:       %+.6f s\n", tod_error());
+	printf("calibration: %d\n", fw_get_calib());
+	printf("interrupts:  INT0 %llu, Timer0 %llu", sim.int0_cnt, sim.t0_cnt);
+	if (sim.int0_lost)
+		printf(", INT0 edges lost %llu", sim.int0_lost);
+	if (sim.t1_isrs)
+		printf(", Timer1 %llu", sim.t1_isrs);
+	putchar('\n');
+	if (sim.resets)
+		printf("resets:      %u\n", sim.resets);
+	if (sim.rc_model || OSCCAL != OSCCAL_FACTORY)
+		printf("oscillator:  OSCCAL 0x%02x, CPU clock %+.2f %%\n", OSCCAL, (1 / sim.rc - 1) * 100);
+	if (span > 0) {
+		printf("current:     %.3f mA average (MCU %.3f mA, display %.3f mA, crystal %.3f mA), "
+			"CPU active %.2f %%\n", (cpu + led) / span * 1e3 + I_XTAL * 1e3, cpu / span * 1e3,
+			led / span * 1e3, I_XTAL * 1e3, sim.t_active / span * 100);
+	}
+	if (sim.t_slow > 0) {
+		printf("             CPU clock divided %.1f %% of the time, MCU would draw %.3f mA at full speed\n",
+			sim.t_slow / span * 100, sim.q_full / span * 1e3);
+	}
+	if (sim.span[0] > 0) {
+		printf("             %.3f mA with supply, %.1f uA on hold-up (%.1f %% in power-down)\n",
+			(sim.q_cpu[1] + sim.q_led[1]) / sim.span[1] * 1e3 + I_XTAL * 1e3,
+			(sim.q_cpu[0] + sim.q_led[0]) / sim.span[0] * 1e6 + I_XTAL * 1e6,
+			sim.t_pdown / sim.span[0] * 100);
+	}
+	for (int i = 0; i <= E2END; ++i) {
+		if (sim.ee_cell[i] > cell)
+			cell = sim.ee_cell[i];
+	}
+	printf("eeprom:      %llu byte writes, at most %lu to a cell (%.1f per year)\n",
+		sim.ee_writes, cell, cell / (sim.now / SIM_HZ / YEAR));
+
+	if (sim.uart_rx || sim.uart_tx) {
+		printf("uart:        %lu bytes received, %lu sent, %lu garbled\n",
+			sim.uart_rx, sim.uart_tx, sim.uart_errors);
+	}
+	if (sim.tel_frames)
+		printf("telemetry:   %lu frames\n", sim.tel_frames);
+	if (sim.nmea)
+		printf("nmea:        %lu sentences fed, %.1f per second\n", sim.nmea, sim.nmea / (sim.now / SIM_HZ));
+
+	for (int i = 0; i < sim.nstop; ++i)
+		printf("crystal:     stopped at %.3f s for %.3f s\n", sim.stop[i].at / SIM_HZ, sim.stop[i].len / SIM_HZ);
+
+	for (int i = 0; i < sim.noutage; ++i) {
+		const struct outage *o = &sim.outage[i];
+
+		printf("power fail:  at %.3f s for %.3f s, ", o->at / SIM_HZ, o->len / SIM_HZ);
+		if (!o->writes)
+			printf("nothing saved");
+		else
+			printf("%d bytes saved in %.1f ms", o->saves, (o->saved - o->at) / SIM_HZ * 1000);
+		if (o->writes > o->saves)
+			printf(" (%d more later)", o->writes - o->saves);
+		printf(", hold-up %.1f ms%s\n", o->holdup / SIM_HZ * 1000,
+			!o->died ? ", survived" : o->torn ? ", TORN WRITE" : "");
+	}
+
+	if (sim.trace_path != NULL) {
+		printf("trace:       %llu events, %llu bytes (%.1f kB/h)\n",
+			(unsigned long long)sim.trace.events,
+			(unsigned long long)sim.trace.bytes,
+			sim.trace.bytes / 1024.0 / (sim.now / SIM_HZ / 3600));
+	}
+}
+
+
+/* Time error of a clock ideally corrected for the mean crystal
+ * error over a year, only temperature and aging remain */
+static void bench_ideal(const double *check, double *err, int n)
+{
+	const double step = 60;
+	double mean = 0, acc = 0, t = 0;
+
+	for (t = 0; t < YEAR; t += step)
+		mean += xtal_ppm((t + step / 2) * SIM_HZ) * step;
+	mean /= YEAR;
+
+	for (t = 0; n; t += step) {
+		if (t >= *check) {
+			*err++ = acc;
+			++check;
+			--n;
+		}
+		acc += (xtal_ppm((t + step / 2) * SIM_HZ) - mean) * 1e-6 * step;
+	}
+}
+
+
+static void bench_row(const char *name, const double *err)
+{
+	printf("%6s %12.3f %12.3f %12.3f %+12.3f\n", name, err[0], err[1], err[2],
+		err[2] / YEAR * 1e6);
+}
+
+
+/* Every run forks from the pristine process, so each one starts
+ * with a freshly booted firmware. Runs are executed in parallel */
+static int bench(const int *calib, int n)
+{
+	static const double check[] = { DAY * SIM_HZ, 7 * DAY * SIM_HZ, YEAR * SIM_HZ };
+	const double check_s[] = { DAY, 7 * DAY, YEAR };
+	double err[3], best = 0;
+	int best_calib = 0, fd[MAX_BENCH];
+	char name[16];
+
+	printf("crystal: %+.3f ppm at 25 C, %.3f ppm/C2, %.1f C +-%.1f C, aging %+.3f ppm/year\n",
+		sim.xtal_ppm, sim.xtal_tc, sim.temp_mean, sim.temp_swing, sim.aging);
+	printf("%6s %12s %12s %12s %12s\n", "calib", "day [s]", "week [s]", "year [s]", "year [ppm]");
+
+	for (int i = 0; i < n; ++i) {
+		int p[2];
+		pid_t pid;
+
+		if (pipe(p) < 0 || (pid = fork()) < 0) {
+			perror("fork");
+			return 1;
+		}
+
+		if (!pid) {
+			close(p[0]);
+			sim.calib_set = 1;
+			sim.calib = calib[i];
+			sim.fast = 1;
+			sim.end = YEAR * SIM_HZ;
+			sim.check = check;
+			sim.check_err = err;
+			sim.ncheck = 3;
+			run();
+			if (write(p[1], err, sizeof(err)) != sizeof(err))
+				_exit(1);
+			_exit(0);
+		}
+
+		close(p[1]);
+		fd[i] = p[0];
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (read(fd[i], err, sizeof(err)) != sizeof(err)) {
+			fprintf(stderr, "Run with calibration %d failed\n", calib[i]);
+			return 1;
+		}
+		close(fd[i]);
+
+		snprintf(name, sizeof(name), "%d", calib[i]);
+		bench_row(name, err);
+
+		if (!i || fabs(err[2]) < best) {
+			best = fabs(err[2]);
+			best_calib = calib[i];
+		}
+	}
+
+	while (wait(NULL) > 0)
+		;
+
+	bench_ideal(check_s, err, 3);
+	bench_row("ideal", err);
+
+	printf("best: calibration %d, %.3f s/year (ideal constant correction %.3f s/year)\n",
+		best_calib, best, fabs(err[2]));
+
+	return 0;
+}
+
+
+/* Clock of a sync run, f is NULL for the master */
+static void sync_clock(const struct follower *f, int (*bus)[2], int n, int i)
+{
+	for (int j = 0; j < n; ++j) {
+		if (f == NULL)
+			sim.sync_out[sim.nsync_out++] = bus[j][1];
+		else
+			close(bus[j][1]);
+		if (j != i || f == NULL)
+			close(bus[j][0]);
+	}
+
+	if (f == NULL) {
+		sim.sync = sync_master;
+		signal(SIGPIPE, SIG_IGN);
+		return;
+	}
+
+	/* Own crystal, its ticks out of phase with the others */
+	sim.sync = sync_follower;
+	sim.sync_offset = f->offset;
+	sim.sync_in = bus[i][0];
+	sim.sync_bus = 1;
+	sim.xtal_ppm = f->ppm;
+	sim.xtal_half = xtal_half_period(0);
+	sim.xtal_origin = fmod((i + 1) * 0.618034, 1) * 2 * sim.xtal_half;
+	sim.xtal_edges = 0;
+	xtal_advance(0);
+	sync_fetch();
+}
+
+
+/* Master and followers on one sync line. Every clock forks from the
+ * pristine process and they run in parallel, the master's line
+ * changes are piped to the followers (they only listen). Errors
+ * of the followers are reported relative to the master. */
+static int sync_run(const struct follower *f, int n)
+{
+	double check[SYNC_CHECKS], err[SYNC_CHECKS + 1], res[MAX_FOLLOWERS + 1][SYNC_CHECKS + 1];
+	int bus[MAX_FOLLOWERS][2], fd[MAX_FOLLOWERS + 1];
+	char name[16];
+
+	for (int k = 0; k < SYNC_CHECKS; ++k)
+		check[k] = sim.end * (k + 1) / SYNC_CHECKS;
+
+	for (int i = 0; i < n; ++i) {
+		if (pipe(bus[i]) < 0) {
+			perror("pipe");
+			return 1;
+		}
+	}
+
+	/* Clock 0 is the master */
+	for (int i = 0; i <= n; ++i) {
+		int p[2];
+		pid_t pid;
+
+		if (pipe(p) < 0 || (pid = fork()) < 0) {
+			perror("fork");
+			return 1;
+		}
+
+		if (!pid) {
+			close(p[0]);
+			sync_clock(i ? &f[i - 1] : NULL, bus, n, i - 1);
+			sim.check = check;
+			sim.check_err = err;
+			sim.ncheck = SYNC_CHECKS;
+			run();
+			err[SYNC_CHECKS] = fw_get_calib();
+			if (write(p[1], err, sizeof(err)) != sizeof(err))
+				_exit(1);
+			_exit(0);
+		}
+
+		close(p[1]);
+		fd[i] = p[0];
+	}
+
+	for (int i = 0; i < n; ++i) {
+		close(bus[i][0]);
+		close(bus[i][1]);
+	}
+
+	for (int i = 0; i <= n; ++i) {
+		if (read(fd[i], res[i], sizeof(err)) != sizeof(err)) {
+			fprintf(stderr, "Run of clock %d failed\n", i);
+			return 1;
+		}
+		close(fd[i]);
+	}
+
+	while (wait(NULL) > 0)
+		;
+
+	printf("sync line: master %+.3f ppm", sim.xtal_ppm);
+	for (int i = 0; i < n; ++i)
+		printf(", %d: %+.3f ppm %+.3f s", i + 1, f[i].ppm, f[i].offset);
+	printf("\n%10s %12s", "time [s]", "master [s]");
+	for (int i = 0; i < n; ++i) {
+		snprintf(name, sizeof(name), "%d [ms]", i + 1);
+		printf(" %10s", name);
+	}
+	putchar('\n');
+
+	for (int k = 0; k < SYNC_CHECKS; ++k) {
+		printf("%10.0f %+12.6f", check[k] / SIM_HZ, res[0][k]);
+		for (int i = 1; i <= n; ++i)
+			printf(" %+10.3f", (res[i][k] - res[0][k]) * 1e3);
+		putchar('\n');
+	}
+
+	printf("%10s %12.0f", "calib", res[0][SYNC_CHECKS]);
+	for (int i = 1; i <= n; ++i)
+		printf(" %10.0f", res[i][SYNC_CHECKS]);
+	putchar('\n');
+
+	return 0;
+}
+
+
+static void add_reset(const struct reset *r)
+{
+	int i;
+
+	for (i = sim.nreset++; i > 0 && sim.reset[i - 1].at > r->at; --i)
+		sim.reset[i] = sim.reset[i - 1];
+	sim.reset[i] = *r;
+}
+
+
+static void add_uart(const struct uart_line *l)
+{
+	int i;
+
+	if ((sim.nuart & 0xff) == 0 &&
+			(sim.uart = realloc(sim.uart, (sim.nuart + 256) * sizeof(*l))) == NULL)
+		exit(1);
+
+	for (i = sim.nuart++; i > 0 && sim.uart[i - 1].at > l->at; --i)
+		sim.uart[i] = sim.uart[i - 1];
+	sim.uart[i] = *l;
+}
+
+
+/* Time of day of a sentence with a time field, -1 if none */
+static long nmea_time(const char *line)
+{
+	const char *f = strchr(line, ',');
+	int h, m, s;
+
+	if (f == NULL || f - line != 5 || (strncmp(line + 2, "RMC", 3) &&
+			strncmp(line + 2, "ZDA", 3) && strncmp(line + 2, "GGA", 3)))
+		return -1;
+
+	if (sscanf(f + 1, "%2d%2d%2d", &h, &m, &s) != 3)
+		return -1;
+
+	return h * 3600 + m * 60 + s;
+}
+
+
+/* Sentences are grouped by their time, groups are sent after
+ * the PPS edge at the time they carry, gaps in the log stay */
+static void nmea_load(const char *path)
+{
+	struct uart_line l = { 0 };
+	long first = -1, t;
+	size_t size = 0;
+	char *line = NULL;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	l.quiet = 1;
+	l.at = NMEA_DELAY * SIM_HZ;
+
+	while (getline(&line, &size, f) > 0) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] != '$')
+			continue;
+
+		if ((t = nmea_time(line + 1)) >= 0) {
+			if (first < 0) {
+				first = t;
+				sim.start_tod = t;
+			}
+			l.at = ((t - first + 86400) % 86400 + NMEA_DELAY) * SIM_HZ;
+		}
+
+		if ((l.text = strdup(line)) == NULL)
+			exit(1);
+		add_uart(&l);
+		++sim.nmea;
+	}
+
+	free(line);
+	fclose(f);
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s seconds] [-d days] [-T hh:mm:ss] [-u] "
+		"[-p ppm] [-k ppm/C2] [-m C] [-a C] [-g ppm] [-c calib] [-B c,c,...] "
+		"[-P] [-b t:n:len] [-r t:c[:len]] [-F t:len[:h]] [-o err[:tc]] [-X t:len] [-L t:lux] [-U t:text] [-N file] [-S f,f,...] [-W file] [-E] [-t trace] [-f] [-l]\n", name);
+	exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct timespec ts0, ts1;
+	uint8_t val[TRACE_CHANNELS];
+	int h, m, s, opt, nbench = 0, nfollow = 0;
+	int bench_calib[MAX_BENCH];
+	struct follower follow[MAX_FOLLOWERS];
+	char *tok, cause;
+
+	sim.end = 60 * SIM_HZ;
+	sim.start_tod = 12 * 3600;
+	sim.xtal_tc = -0.034;
+	sim.temp_mean = 25;
+	sim.rc = 1;
+	sim.light_release = -INFINITY;
+	memset(sim.eeprom, 0xff, sizeof(sim.eeprom));
+
+	while ((opt = getopt(argc, argv, "s:d:T:up:k:m:a:g:c:B:Pb:r:F:o:X:L:U:N:S:W:Et:fl")) != -1) {
+		switch (opt) {
+			case 's':
+				sim.end = atof(optarg) * SIM_HZ;
+				break;
+
+			case 'd':
+				sim.end = atof(optarg) * 86400 * SIM_HZ;
+				break;
+
+			case 'T':
+				if (sscanf(optarg, "%d:%d:%d", &h, &m, &s) != 3)
+					usage(argv[0]);
+				sim.start_tod = (h * 3600 + m * 60 + s) % 86400;
+				break;
+
+			case 'u':
+				sim.unset = 1;
+				break;
+
+			case 'p':
+				sim.xtal_ppm = atof(optarg);
+				break;
+
+			case 'k':
+				sim.xtal_tc = atof(optarg);
+				break;
+
+			case 'm':
+				sim.temp_mean = atof(optarg);
+				break;
+
+			case 'a':
+				sim.temp_swing = atof(optarg);
+				break;
+
+			case 'g':
+				sim.aging = atof(optarg);
+				break;
+
+			case 'c':
+				sim.calib_set = 1;
+				sim.calib = atoi(optarg);
+				break;
+
+			case 'P':
+				sim.pps = 1;
+				break;
+
+			case 'B':
+				for (tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+					if (nbench >= MAX_BENCH)
+						usage(argv[0]);
+					bench_calib[nbench++] = atoi(tok);
+				}
+				break;
+
+			case 'b': {
+				struct press *p = &sim.press[sim.npress];
+
+				if (sim.npress >= MAX_PRESSES ||
+						sscanf(optarg, "%lf:%d:%lf", &p->at, &p->which, &p->len) != 3)
+					usage(argv[0]);
+				p->at *= SIM_HZ;
+				p->len *= SIM_HZ;
+				++sim.npress;
+				break;
+			}
+
+			case 'r': {
+				/* Causes in MCUSR bit order */
+				static const char causes[] = "pebw";
+				struct reset r = { 0 };
+
+				if (sim.nreset >= MAX_RESETS ||
+						sscanf(optarg, "%lf:%c:%lf", &r.at, &cause, &r.len) < 2 ||
+						!cause || (tok = strchr(causes, cause)) == NULL)
+					usage(argv[0]);
+
+				r.cause = 1 << (tok - causes);
+				r.at *= SIM_HZ;
+				r.len *= SIM_HZ;
+				add_reset(&r);
+				break;
+			}
+
+			case 'F': {
+				struct outage *o = &sim.outage[sim.noutage];
+				struct reset r = { 0 };
+
+				o->holdup = HOLDUP;
+				if (sim.noutage >= MAX_OUTAGES || sim.nreset >= MAX_RESETS ||
+						sscanf(optarg, "%lf:%lf:%lf", &o->at, &o->len, &o->holdup) < 2)
+					usage(argv[0]);
+
+				o->at *= SIM_HZ;
+				o->len *= SIM_HZ;
+				o->holdup *= SIM_HZ;
+				++sim.noutage;
+
+				/* MCU dies, power-on reset when the supply is back */
+				if (o->holdup < o->len) {
+					r.at = o->at + o->holdup;
+					r.len = o->len - o->holdup;
+					r.cause = 1 << PORF;
+					add_reset(&r);
+				}
+				break;
+			}
+
+			case 'o':
+				sim.rc_model = 1;
+				if (sscanf(optarg, "%lf:%lf", &sim.rc_err, &sim.rc_tc) < 1)
+					usage(argv[0]);
+				break;
+
+			case 'X': {
+				struct stop *x = &sim.stop[sim.nstop];
+
+				if (sim.nstop >= MAX_STOPS || sscanf(optarg, "%lf:%lf", &x->at, &x->len) != 2)
+					usage(argv[0]);
+
+				x->at *= SIM_HZ;
+				x->len *= SIM_HZ;
+				++sim.nstop;
+				break;
+			}
+
+			case 'L': {
+				struct light l;
+				int i;
+
+				if (sim.nlight >= MAX_LIGHTS || sscanf(optarg, "%lf:%lf", &l.at, &l.lux) != 2 || l.lux <= 0)
+					usage(argv[0]);
+
+				l.at *= SIM_HZ;
+				for (i = sim.nlight++; i > 0 && sim.light[i - 1].at > l.at; --i)
+					sim.light[i] = sim.light[i - 1];
+				sim.light[i] = l;
+				break;
+			}
+
+			case 'U': {
+				struct uart_line l = { 0 };
+				int n = 0;
+
+				if (sscanf(optarg, "%lf:%n", &l.at, &n) < 1 || !n)
+					usage(argv[0]);
+
+				l.at *= SIM_HZ;
+				l.text = optarg + n;
+				add_uart(&l);
+				break;
+			}
+
+			case 'N':
+				nmea_load(optarg);
+				break;
+
+			case 'S':
+				for (tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+					struct follower *f = &follow[nfollow];
+
+					f->offset = 0;
+					if (nfollow >= MAX_FOLLOWERS || sscanf(tok, "%lf:%lf", &f->ppm, &f->offset) < 1)
+						usage(argv[0]);
+					++nfollow;
+				}
+				break;
+
+			case 'E':
+				sim.dump_eeprom = 1;
+				break;
+
+			case 'W':
+				if ((sim.uart_file = fopen(optarg, "wb")) == NULL) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+
+			case 't':
+				sim.trace_path = optarg;
+				break;
+
+			case 'f':
+				sim.fast = 1;
+				break;
+
+			case 'l':
+				sim.latency = 1;
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	sim.xtal_half = xtal_half_period(0);
+	xtal_advance(0);
+
+	if ((sim.fwdata = malloc(__stop_fwdata - __start_fwdata + 1)) == NULL)
+		return 1;
+	memcpy(sim.fwdata, __start_fwdata, __stop_fwdata - __start_fwdata);
+	power_on();
+
+	if (nbench)
+		return bench(bench_calib, nbench);
+
+	if (nfollow)
+		return sync_run(follow, nfollow);
+
+	if (sim.trace_path != NULL) {
+		ports_get(val);
+		if (trace_create(&sim.trace, sim.trace_path, val) < 0) {
+			perror(sim.trace_path);
+			return 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+	run();
+
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+
+	trace_close(&sim.trace);
+	if (sim.uart_file != NULL)
+		fclose(sim.uart_file);
+	report(ts1.tv_sec - ts0.tv_sec + (ts1.tv_nsec - ts0.tv_nsec) * 1e-9);
+
+	if (sim.dump_eeprom)
+		eeprom_dump();
+
+	return 0;
+}
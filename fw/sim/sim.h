@@ -0,0 +1,47 @@
+/* LEDclock host simulator
+ *
+ * The firmware is compiled for the host (fw.c) against the
+ * <avr/...> replacements in this directory. Simulator (sim.c)
+ * models the 32 kHz crystal with 4060 divider, Timer0 and the
+ * buttons, and calls interrupt handlers in the order the MCU
+ * would. Time unit is one cycle of the nominal 8 MHz CPU clock.
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#define SIM_HZ  8000000.0
+#define XTAL_HZ 2048.0     /* 4060 output connected to INT0 */
+
+
+/* Firmware side, see fw.c */
+struct fw_time {
+	int hours;
+	int minutes;
+	int seconds;
+	int subseconds;
+	int set;
+};
+
+
+int fw_main(void);
+
+void fw_get_time(struct fw_time *t);
+
+void fw_set_time(const struct fw_time *t);
+
+int fw_get_calib(void);
+
+void fw_set_calib(int calib);
+
+void fw_set_sync(int master);
+
+int fw_display_static(void);
+
+long fw_fast_forward(long max);
+
+#endif
@@ -0,0 +1,429 @@
+/* LEDclock host simulator
+ * Delta-encoded binary port trace
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#include <string.h>
+
+#include "trace.h"
+
+#define KEYFRAME_SIZE (1 + 8 + TRACE_CHANNELS)
+#define COPY_MAX      (1 + 1 + 5)
+
+
+static unsigned int block_start(long block)
+{
+	return block ? 0 : TRACE_HDR;
+}
+
+
+static void hist_push(struct trace_history *h, const struct trace_event *ev)
+{
+	h->head = (h->head + 1) % TRACE_HISTORY;
+	h->ev[h->head] = *ev;
+	if (h->cnt < TRACE_HISTORY)
+		++h->cnt;
+}
+
+
+/* Event dist events back, 1 is the most recent one */
+static const struct trace_event *hist_get(const struct trace_history *h, unsigned int dist)
+{
+	if (dist == 0 || dist > h->cnt)
+		return NULL;
+
+	return &h->ev[(h->head + TRACE_HISTORY + 1 - dist) % TRACE_HISTORY];
+}
+
+
+static int event_equal(const struct trace_event *a, const struct trace_event *b)
+{
+	if (a->dt != b->dt || a->mask != b->mask)
+		return 0;
+
+	for (int i = 0; i < TRACE_CHANNELS; ++i) {
+		if ((a->mask & (1 << i)) && a->val[i] != b->val[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static unsigned int put_leb128(uint8_t *p, uint64_t v)
+{
+	unsigned int n = 0;
+
+	do {
+		p[n] = v & 0x7f;
+		v >>= 7;
+		if (v)
+			p[n] |= 0x80;
+		++n;
+	} while (v);
+
+	return n;
+}
+
+
+static void put_keyframe(struct trace_writer *w, uint64_t time)
+{
+	w->buf[w->pos++] = TRACE_KEYFRAME;
+
+	for (int i = 0; i < 8; ++i)
+		w->buf[w->pos++] = time >> (8 * i);
+
+	for (int i = 0; i < TRACE_CHANNELS; ++i)
+		w->buf[w->pos++] = w->val[i];
+
+	w->hist.cnt = 0;
+}
+
+
+static void put_copy(struct trace_writer *w)
+{
+	if (!w->copy_cnt)
+		return;
+
+	w->buf[w->pos++] = TRACE_COPY;
+	w->buf[w->pos++] = w->copy_dist;
+	w->pos += put_leb128(w->buf + w->pos, w->copy_cnt);
+	w->copy_cnt = 0;
+}
+
+
+static void flush_block(struct trace_writer *w)
+{
+	put_copy(w);
+	memset(w->buf + w->pos, 0, TRACE_BLOCK - w->pos);
+	fwrite(w->buf, 1, TRACE_BLOCK, w->f);
+	w->bytes += TRACE_BLOCK;
+	w->pos = 0;
+}
+
+
+int trace_create(struct trace_writer *w, const char *path, const uint8_t *val)
+{
+	memset(w, 0, sizeof(*w));
+
+	if ((w->f = fopen(path, "wb")) == NULL)
+		return -1;
+
+	memcpy(w->buf, TRACE_MAGIC, 4);
+	w->buf[4] = TRACE_VERSION;
+	w->buf[5] = TRACE_CHANNELS;
+	w->buf[8] = TRACE_HZ & 0xff;
+	w->buf[9] = (TRACE_HZ >> 8) & 0xff;
+	w->buf[10] = (TRACE_HZ >> 16) & 0xff;
+	w->buf[11] = (TRACE_HZ >> 24) & 0xff;
+	w->pos = TRACE_HDR;
+
+	memcpy(w->val, val, TRACE_CHANNELS);
+	put_keyframe(w, 0);
+
+	return 0;
+}
+
+
+/* Returns distance to an equal event in history, 0 if none */
+static unsigned int find_copy(const struct trace_writer *w, const struct trace_event *ev)
+{
+	const struct trace_event *h;
+	unsigned int best = 0, best_len = 0;
+
+	/* Stick to the distance of the current run as long as it lasts */
+	if (w->copy_cnt) {
+		h = hist_get(&w->hist, w->copy_dist);
+		return event_equal(h, ev) ? w->copy_dist : 0;
+	}
+
+	/* Prefer the distance that explains most of the recent events,
+	 * so the multiplex frame period wins over chance matches */
+	for (unsigned int d = 1; (h = hist_get(&w->hist, d)) != NULL; ++d) {
+		unsigned int len = 0;
+
+		if (!event_equal(h, ev))
+			continue;
+
+		while (d + len + 1 <= w->hist.cnt &&
+				event_equal(hist_get(&w->hist, len + 1), hist_get(&w->hist, d + len + 1)))
+			++len;
+
+		if (best == 0 || len > best_len) {
+			best = d;
+			best_len = len;
+		}
+	}
+
+	return best;
+}
+
+
+void trace_write(struct trace_writer *w, uint64_t time, const uint8_t *val)
+{
+	struct trace_event ev = { 0 };
+	unsigned int n, dist, size;
+	uint64_t dt = time - w->last;
+	uint8_t tmp[10];
+
+	for (int i = 0; i < TRACE_CHANNELS; ++i) {
+		if (val[i] != w->val[i]) {
+			ev.mask |= 1 << i;
+			ev.val[i] = val[i];
+		}
+	}
+
+	if (!ev.mask)
+		return;
+
+	/* Deltas that don't fit are stored as literal events only */
+	ev.dt = dt > UINT32_MAX ? UINT32_MAX : dt;
+
+	++w->events;
+	w->last = time;
+	memcpy(w->val, val, TRACE_CHANNELS);
+
+	if (ev.dt != UINT32_MAX && (dist = find_copy(w, &ev)) != 0) {
+		w->copy_dist = dist;
+		++w->copy_cnt;
+		hist_push(&w->hist, &ev);
+		return;
+	}
+
+	n = put_leb128(tmp, dt);
+	size = 1 + n + __builtin_popcount(ev.mask);
+
+	/* Pending copy always has to fit */
+	if (w->pos + size + COPY_MAX > TRACE_BLOCK) {
+		/* Event starts a new block, keyframe carries it */
+		flush_block(w);
+		put_keyframe(w, time);
+		return;
+	}
+
+	put_copy(w);
+
+	w->buf[w->pos++] = ev.mask;
+	memcpy(w->buf + w->pos, tmp, n);
+	w->pos += n;
+
+	for (int i = 0; i < TRACE_CHANNELS; ++i) {
+		if (ev.mask & (1 << i))
+			w->buf[w->pos++] = val[i];
+	}
+
+	hist_push(&w->hist, &ev);
+}
+
+
+void trace_close(struct trace_writer *w)
+{
+	if (w->f == NULL)
+		return;
+
+	/* No padding after the last block, reader treats EOF as its end */
+	put_copy(w);
+	fwrite(w->buf, 1, w->pos, w->f);
+	w->bytes += w->pos;
+	fclose(w->f);
+	w->f = NULL;
+}
+
+
+static uint64_t keyframe_time(const uint8_t *p)
+{
+	uint64_t time = 0;
+
+	for (int i = 0; i < 8; ++i)
+		time |= (uint64_t)p[1 + i] << (8 * i);
+
+	return time;
+}
+
+
+static int load_block(struct trace_reader *r, long block)
+{
+	if (block >= r->blocks)
+		return -1;
+
+	fseek(r->f, block * TRACE_BLOCK, SEEK_SET);
+	r->len = fread(r->buf, 1, TRACE_BLOCK, r->f);
+	r->pos = block_start(block);
+	r->block = block;
+
+	if (r->len < r->pos + KEYFRAME_SIZE || r->buf[r->pos] != TRACE_KEYFRAME)
+		return -1;
+
+	r->next_time = keyframe_time(r->buf + r->pos);
+	memcpy(r->next_val, r->buf + r->pos + 9, TRACE_CHANNELS);
+	r->pos += KEYFRAME_SIZE;
+	r->hist.cnt = 0;
+	r->copy_cnt = 0;
+	r->ahead = 1;
+
+	return 0;
+}
+
+
+static int block_time(struct trace_reader *r, long block, uint64_t *time)
+{
+	uint8_t kf[KEYFRAME_SIZE];
+
+	fseek(r->f, block * TRACE_BLOCK + block_start(block), SEEK_SET);
+	if (fread(kf, 1, sizeof(kf), r->f) != sizeof(kf) || kf[0] != TRACE_KEYFRAME)
+		return -1;
+
+	*time = keyframe_time(kf);
+
+	return 0;
+}
+
+
+int trace_open(struct trace_reader *r, const char *path)
+{
+	uint8_t hdr[TRACE_HDR];
+	long size;
+
+	memset(r, 0, sizeof(*r));
+
+	if ((r->f = fopen(path, "rb")) == NULL)
+		return -1;
+
+	if (fread(hdr, 1, sizeof(hdr), r->f) != sizeof(hdr) ||
+			memcmp(hdr, TRACE_MAGIC, 4) || hdr[4] != TRACE_VERSION ||
+			hdr[5] != TRACE_CHANNELS) {
+		trace_release(r);
+		return -1;
+	}
+
+	fseek(r->f, 0, SEEK_END);
+	size = ftell(r->f);
+	r->blocks = (size + TRACE_BLOCK - 1) / TRACE_BLOCK;
+
+	return trace_seek(r, 0);
+}
+
+
+static int get_leb128(struct trace_reader *r, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	do {
+		if (r->pos >= r->len || shift > 63)
+			return -1;
+		*v |= (uint64_t)(r->buf[r->pos] & 0x7f) << shift;
+		shift += 7;
+	} while (r->buf[r->pos++] & 0x80);
+
+	return 0;
+}
+
+
+static void apply(struct trace_reader *r, const struct trace_event *ev, uint64_t dt)
+{
+	r->next_time += dt;
+
+	for (int i = 0; i < TRACE_CHANNELS; ++i) {
+		if (ev->mask & (1 << i))
+			r->next_val[i] = ev->val[i];
+	}
+
+	hist_push(&r->hist, ev);
+}
+
+
+/* Decodes following state change into r->next_time/next_val */
+static int fetch(struct trace_reader *r)
+{
+	struct trace_event ev = { 0 };
+	uint64_t v;
+
+	if (r->copy_cnt) {
+		ev = *hist_get(&r->hist, r->copy_dist);
+		--r->copy_cnt;
+		apply(r, &ev, ev.dt);
+		return 0;
+	}
+
+	if (r->pos >= r->len || (ev.mask = r->buf[r->pos]) == 0)
+		return load_block(r, r->block + 1);
+
+	++r->pos;
+
+	if (ev.mask == TRACE_COPY) {
+		if (r->pos >= r->len)
+			return -1;
+		r->copy_dist = r->buf[r->pos++];
+		if (get_leb128(r, &v) < 0 || !v || hist_get(&r->hist, r->copy_dist) == NULL)
+			return -1;
+		r->copy_cnt = v;
+		return fetch(r);
+	}
+
+	if (ev.mask & ~((1 << TRACE_CHANNELS) - 1) || get_leb128(r, &v) < 0)
+		return -1;
+
+	ev.dt = v > UINT32_MAX ? UINT32_MAX : v;
+	for (int i = 0; i < TRACE_CHANNELS; ++i) {
+		if (ev.mask & (1 << i)) {
+			if (r->pos >= r->len)
+				return -1;
+			ev.val[i] = r->buf[r->pos++];
+		}
+	}
+
+	apply(r, &ev, v);
+
+	return 0;
+}
+
+
+int trace_next(struct trace_reader *r)
+{
+	if (!r->ahead)
+		return -1;
+
+	r->time = r->next_time;
+	memcpy(r->val, r->next_val, TRACE_CHANNELS);
+	r->ahead = fetch(r) == 0;
+
+	return 0;
+}
+
+
+int trace_seek(struct trace_reader *r, uint64_t time)
+{
+	long lo = 0, hi = r->blocks - 1;
+	uint64_t t;
+
+	/* Last block starting at or before time */
+	while (lo < hi) {
+		long mid = (lo + hi + 1) / 2;
+
+		if (block_time(r, mid, &t) < 0 || t > time)
+			hi = mid - 1;
+		else
+			lo = mid;
+	}
+
+	if (load_block(r, lo) < 0)
+		return -1;
+
+	trace_next(r);
+	while (r->ahead && r->next_time <= time)
+		trace_next(r);
+
+	return 0;
+}
+
+
+void trace_release(struct trace_reader *r)
+{
+	if (r->f != NULL)
+		fclose(r->f);
+	r->f = NULL;
+}
@@ -0,0 +1,110 @@
+/* LEDclock host simulator
+ * Delta-encoded binary port trace
+ *
+ * File is a sequence of TRACE_BLOCK sized blocks. Each block
+ * starts with a keyframe holding the absolute time and all
+ * channel values, so a reader can binary search blocks by time
+ * and decode forward from there. Block 0 is preceded by
+ * a short file header.
+ *
+ * Record layout (within a block):
+ * - 0x00             - padding up to the end of the block,
+ * - 0x80, t, v[n]    - keyframe: 64-bit LE absolute time, all values,
+ * - 0x40, d, cnt     - copy: repeat cnt (LEB128) events starting d events
+ *                      back, d <= TRACE_HISTORY. Static display multiplex
+ *                      repeats every frame, so most events end up here,
+ * - mask, dt, v[...] - event: mask of changed channels (bits 0-5),
+ *                      LEB128 time delta, one value per set bit.
+ *
+ * Times are in simulator cycles (TRACE_HZ per second).
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#ifndef SIM_TRACE_H
+#define SIM_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC    "LCTR"
+#define TRACE_VERSION  1
+#define TRACE_BLOCK    4096
+#define TRACE_HDR      12
+#define TRACE_CHANNELS 3      /* PORTA, PORTB, PORTD */
+#define TRACE_HZ       8000000
+#define TRACE_HISTORY  32     /* Events a copy can refer back to */
+#define TRACE_KEYFRAME 0x80
+#define TRACE_COPY     0x40
+
+
+struct trace_event {
+	uint32_t dt;
+	uint8_t mask;
+	uint8_t val[TRACE_CHANNELS];
+};
+
+
+struct trace_history {
+	struct trace_event ev[TRACE_HISTORY];
+	unsigned int head;
+	unsigned int cnt;
+};
+
+
+struct trace_writer {
+	FILE *f;
+	uint8_t buf[TRACE_BLOCK];
+	unsigned int pos;
+	uint64_t last;
+	uint8_t val[TRACE_CHANNELS];
+	struct trace_history hist;
+	unsigned int copy_dist;
+	unsigned int copy_cnt;
+	uint64_t events;
+	uint64_t bytes;
+};
+
+
+struct trace_reader {
+	FILE *f;
+	long blocks;
+	long block;
+	uint8_t buf[TRACE_BLOCK];
+	unsigned int pos;
+	unsigned int len;
+	struct trace_history hist;
+	unsigned int copy_dist;
+	unsigned int copy_cnt;
+
+	/* Decoded, but not yet returned state change */
+	int ahead;
+	uint64_t next_time;
+	uint8_t next_val[TRACE_CHANNELS];
+
+	/* Current state */
+	uint64_t time;
+	uint8_t val[TRACE_CHANNELS];
+};
+
+
+int trace_create(struct trace_writer *w, const char *path, const uint8_t *val);
+
+void trace_write(struct trace_writer *w, uint64_t time, const uint8_t *val);
+
+void trace_close(struct trace_writer *w);
+
+
+int trace_open(struct trace_reader *r, const char *path);
+
+/* Positions reader on the last state change at or before time */
+int trace_seek(struct trace_reader *r, uint64_t time);
+
+/* Returns 0 and updates r->time/r->val on success, -1 at the end */
+int trace_next(struct trace_reader *r);
+
+void trace_release(struct trace_reader *r);
+
+#endif
@@ -0,0 +1,37 @@
+/* LEDclock host simulator
+ * Minimal <util/crc16.h> replacement
+ *
+ * Copyright 2022 Aleksander Kaminski
+ *
+ * Free for non-commercial use and education purposes.
+ */
+
+#ifndef SIM_UTIL_CRC16_H
+#define SIM_UTIL_CRC16_H
+
+#include <stdint.h>
+
+/* CRC-8 (polynomial 0x07), C equivalent from avr-libc documentation */
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data)
+{
+	crc ^= data;
+
+	for (int i = 0; i < 8; ++i)
+		crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+
+	return crc;
+}
+
+
+/* CRC-16 XMODEM (polynomial 0x1021), C equivalent from avr-libc documentation */
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+	crc ^= (uint16_t)data << 8;
+
+	for (int i = 0; i < 8; ++i)
+		crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+
+	return crc;
+}
+
+#endif